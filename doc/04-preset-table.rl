@@ -1,6 +1,6 @@
 
 var Colors table:$color->uint
-var Scores table:$color->uint
+var Scores table:$color->uint const
 
 if 1:
     inc Colors[$color] Scores[$color]
@@ -3,13 +3,18 @@
 #define REEL_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include <traildb.h>
 
 typedef enum {
     REEL_UINT = 1,
     REEL_ITEM = 2,
-    REEL_UINTTABLE = 3
+    REEL_UINTTABLE = 3,
+    REEL_HLL = 4,
+    REEL_BITMAP = 5,
+    REEL_QUANTILES = 6,
+    REEL_FUNNEL = 7
 } reel_var_type;
 
 typedef enum {
@@ -21,16 +26,46 @@ typedef enum {
     REEL_OUT_OF_MEMORY = -1,
     REEL_FORK_FAILED = -2,
     REEL_SETPOS_OUT_OF_BOUNDS = -3,
+    REEL_SPILL_FAILED = -4,
+    REEL_OUTPUT_FAILED = -5,
+    REEL_UNKNOWN_COLUMN = -6,
+    REEL_NOT_A_TABLE = -7,
+    REEL_MEMORY_LIMIT = -8,
 
     REEL_TABLE_MISMATCH = -200,
 
     REEL_MERGE_NOT_PARENT = -800,
 } reel_error;
 
+typedef enum {
+    REEL_FORMAT_CSV = 0,
+    REEL_FORMAT_COLUMNAR = 1
+} reel_output_format;
+
+/*
+Rows are output in the order of their keys or, if order_by is set, in
+the order of the values of that column, named as in the CSV header.
+If limit is non-zero, only the first limit rows are output. If scale is
+non-zero, columns that add up over trails, that is uints, tables and
+funnels that aren't constants, are multiplied by it, for instance to
+estimate totals from a sample of trails. Distinct counts of hlls and
+bitmaps and quantiles are not scaled.
+*/
+typedef struct {
+    reel_output_format format;
+    char delimiter;
+    const char *order_by;
+    int descending;
+    uint64_t limit;
+    double scale;
+} reel_output_options;
+
 typedef enum {
     REEL_PARSE_OK = 0,
     REEL_PARSE_UNKNOWN_VARIABLE = -1,
     REEL_PARSE_INVALID_VALUE = -2,
+    REEL_PARSE_OUT_OF_MEMORY = -3,
+    REEL_PARSE_TABLE_MISMATCH = -4,
     REEL_PARSE_UNKNOWN_FIELD = 1,
     REEL_PARSE_EMPTY_TABLE = 2,
     REEL_PARSE_VALUE_UNKNOWN = 3,
@@ -38,9 +73,276 @@ typedef enum {
 } reel_parse_error;
 
 typedef enum {
-    REEL_FLAG_IS_CONST = 1
+    REEL_FLAG_IS_CONST = 1,
+    REEL_FLAG_IS_DERIVED = 2
 } reel_flags;
 
+/*
+Tables are split in fixed-size pages. Cloned contexts share pages
+copy-on-write: a page is only written in place if the table owns it,
+otherwise it is copied on the first write. Pages of an empty table point
+at a shared zero page.
+
+Each page stores its values with its own width. A page starts with the
+width declared for the table and it is promoted to a wider one when a
+value doesn't fit.
+*/
+
+#define REEL_TABLE_PAGE_BITS 9
+#define REEL_TABLE_PAGE_SIZE (1 << REEL_TABLE_PAGE_BITS)
+#define REEL_TABLE_PAGE_MASK (REEL_TABLE_PAGE_SIZE - 1)
+
+typedef enum {
+    REEL_WIDTH_8 = 0,
+    REEL_WIDTH_16 = 1,
+    REEL_WIDTH_32 = 2,
+    REEL_WIDTH_64 = 3
+} reel_table_width;
+
+typedef enum {
+    REEL_PAGE_OWNED = 1
+} reel_page_flags;
+
+/* page flags store the page width above the flag bits */
+#define REEL_PAGE_WIDTH_SHIFT 1
+#define REEL_PAGE_WIDTH(flags) ((reel_table_width)((flags) >> REEL_PAGE_WIDTH_SHIFT))
+
+/*
+Binary tables, see reel_write_table, hold the pages of a table of a
+field: "REELTAB2", the size of the lexicon of the field, a fingerprint
+of the field name and its values, see reel_lexicon_fingerprint, and the
+number of pages as 64-bit integers, then the width of each page, or
+REEL_TABLE_ZERO_PAGE, padded to a multiple of 8 bytes, followed by the
+values of the pages that are not zero.
+*/
+#define REEL_TABLE_MAGIC "REELTAB2"
+#define REEL_TABLE_ZERO_PAGE 0xff
+
+/* memory of a root context and its children, freed in bulk */
+typedef struct _reel_arena reel_arena;
+
+typedef struct {
+    reel_arena *arena;
+    uint64_t num_pages;
+    void **pages;
+    uint8_t *page_flags;
+    reel_table_width width;
+} reel_table;
+
+static inline uint64_t reel_page_get(const void *page,
+                                     reel_table_width width,
+                                     uint64_t idx)
+{
+    switch (width){
+        case REEL_WIDTH_8:
+            return ((const uint8_t*)page)[idx];
+        case REEL_WIDTH_16:
+            return ((const uint16_t*)page)[idx];
+        case REEL_WIDTH_32:
+            return ((const uint32_t*)page)[idx];
+        default:
+            return ((const uint64_t*)page)[idx];
+    }
+}
+
+static inline uint64_t reel_table_get(const reel_table *table, uint64_t idx)
+{
+    uint64_t page = idx >> REEL_TABLE_PAGE_BITS;
+    return reel_page_get(table->pages[page],
+                         REEL_PAGE_WIDTH(table->page_flags[page]),
+                         idx & REEL_TABLE_PAGE_MASK);
+}
+
+/*
+Children of a root context by fork key. Children are kept in a dense
+array in the order of creation. Keys are found through an
+open-addressing hash table or, for items of a field with a direct
+index, through an array indexed by the item value. The last hashed key
+that was activated is kept with the generation of its activation, so
+that runs of events with the same key skip the hash table.
+*/
+typedef struct {
+    uint64_t key;
+    void *child;
+} reel_fork_entry;
+
+typedef struct {
+    reel_fork_entry *children;
+    uint64_t num_children;
+    uint64_t children_size;
+
+    reel_fork_entry *table;
+    uint64_t table_mask;
+    uint64_t num_hashed;
+
+    void ***items;
+    uint64_t *num_items;
+    uint64_t num_fields;
+
+    uint64_t last_key;
+    uint64_t last_generation;
+} reel_fork_map;
+
+/* fork counters of a root context since it was created or cloned */
+typedef struct {
+    uint64_t activations;
+    uint64_t children_created;
+} reel_fork_stats;
+
+/*
+Memory of a root context by consumer, see reel_memory_usage. Children
+are attributed to the fork statement that created the most of them.
+*/
+typedef struct {
+    uint64_t total;
+    uint64_t tables;
+    uint64_t children;
+    uint64_t num_children;
+    uint32_t fork_line;
+    uint64_t fork_children;
+    const char *table_name;
+    uint64_t table_bytes;
+} reel_memory_usage;
+
+/*
+CSV output split in parts of consecutive rows that can be formatted in
+parallel and output in order, see reel_output_split_init.
+*/
+typedef struct {
+    const void *ctx;
+    reel_output_options options;
+    reel_fork_entry *children;
+    uint64_t num_children;
+    uint32_t num_parts;
+} reel_output_split;
+
+/*
+Events of the current trail grouped by the item of a field, see
+reel_fork_group. Groups are found through an open-addressing index of
+group numbers plus one.
+*/
+typedef struct {
+    tdb_item key;
+    uint64_t offset;
+    uint64_t count;
+} reel_partition_group;
+
+typedef struct {
+    uint64_t generation;
+    tdb_field field;
+
+    const tdb_event **events;
+    uint64_t events_size;
+
+    reel_partition_group *groups;
+    uint64_t num_groups;
+    uint64_t groups_size;
+
+    uint64_t *index;
+    uint64_t index_mask;
+} reel_partition;
+
+/*
+Columns of the events of the current trail for programs that are
+evaluated in batches, see reel_batch.c.
+*/
+typedef struct {
+    tdb_item *columns;
+    uint8_t *mask;
+    uint64_t size;
+} reel_batch;
+
+/*
+HyperLogLog sketch of distinct values with 2^REEL_HLL_BITS registers.
+Variables of type REEL_HLL point at a sketch, or are zero if no values
+have been added.
+*/
+#define REEL_HLL_BITS 12
+#define REEL_HLL_SIZE (1 << REEL_HLL_BITS)
+
+typedef struct {
+    uint8_t registers[REEL_HLL_SIZE];
+} reel_hll;
+
+/*
+Exact set of 64-bit values, after Roaring bitmaps. Values are grouped
+in containers by their high 48 bits, sorted by key. A container stores
+the low 16 bits of its values as a sorted array of up to
+REEL_BITMAP_ARRAY_MAX values, or as a bitset of 2^16 bits above that.
+Variables of type REEL_BITMAP point at a bitmap, or are zero if no
+values have been added.
+*/
+#define REEL_BITMAP_ARRAY_MAX 4096
+#define REEL_BITMAP_BITSET_WORDS ((1 << 16) / 64)
+
+typedef struct {
+    uint64_t key;
+    uint64_t cardinality;
+    void *values;
+} reel_bitmap_container;
+
+typedef struct {
+    reel_arena *arena;
+    reel_bitmap_container *containers;
+    uint64_t num_containers;
+    /* log2 of the size of the containers array in bytes */
+    uint32_t containers_bits;
+} reel_bitmap;
+
+/*
+Mergeable histogram of uint values for quantiles, after HDR histograms.
+Values below 2^REEL_QUANTILES_SUB_BITS are counted exactly, larger ones
+in 2^REEL_QUANTILES_SUB_BITS linear buckets per power of two, so that
+quantiles are within 1/2^(REEL_QUANTILES_SUB_BITS + 1) of the true
+value. A group of buckets, one for each power of two, is allocated when
+the first value falls in it.
+*/
+#define REEL_QUANTILES_SUB_BITS 5
+#define REEL_QUANTILES_SUB_SIZE (1 << REEL_QUANTILES_SUB_BITS)
+#define REEL_QUANTILES_GROUPS (64 - REEL_QUANTILES_SUB_BITS + 1)
+
+typedef struct {
+    reel_arena *arena;
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t *groups[REEL_QUANTILES_GROUPS];
+} reel_quantiles;
+
+/*
+A funnel is a sequence of steps that a trail reaches in order, see
+reel_funnel.c. Each step must happen within its window from the
+previous step, and the last step within the funnel window from the
+first step. A zero window is unlimited. Variables of type REEL_FUNNEL
+point at counts of trails that reached each step, or are zero if no
+trail reached the first step.
+*/
+#define REEL_FUNNEL_MAX_STEPS 32
+
+typedef struct {
+    uint32_t num_steps;
+    uint64_t window;
+    const uint64_t *step_windows;
+    const char *const *labels;
+} reel_funnel;
+
+/* sorted runs of children spilled to disk, see reel_spill.c */
+typedef struct {
+    FILE **runs;
+    uint64_t num_runs;
+    /* where runs are written, so that merged runs can be compacted */
+    const char *dir;
+} reel_spill;
+
+/* dictionary of item tuples to ids, shared across threads */
+typedef struct _reel_ids reel_ids;
+
+/* called for each tuple of items and its id, non-zero return stops */
+typedef int (*reel_identity_fn)(const uint64_t *items,
+                                uint32_t num_items,
+                                uint64_t id,
+                                void *state);
+
 typedef struct {
     reel_var_type type;
     const char *name;
@@ -51,6 +353,15 @@ typedef struct {
     reel_var_type table_value_type;
 
     uint64_t flags;
+
+    /* a derived variable is computed from these variables at output */
+    uint32_t operands[2];
+
+    /* percentiles output for a quantiles variable */
+    const double *percentiles;
+    uint32_t num_percentiles;
+
+    const reel_funnel *funnel;
 } reel_var;
 
 #endif /* REEL_H */
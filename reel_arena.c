@@ -0,0 +1,127 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Contexts and tables are allocated from an arena which belongs to a root
+context. Children of the root allocate from the same arena, and all
+memory is released in bulk when the root is freed. Chunks whose size is
+a power of two, like table pages, are recycled through free lists, one
+for each size.
+*/
+
+#define REEL_ARENA_BLOCK_SIZE (1 << 20)
+#define REEL_ARENA_ALIGN 16
+#define REEL_ARENA_MIN_CHUNK_BITS 4
+#define REEL_ARENA_MAX_CHUNK_BITS 48
+
+struct _reel_arena_block {
+    struct _reel_arena_block *next;
+    uint64_t size;
+    uint64_t offset;
+};
+
+#define REEL_ARENA_HEADER_SIZE\
+    ((sizeof(struct _reel_arena_block) + REEL_ARENA_ALIGN - 1) &\
+     ~(uint64_t)(REEL_ARENA_ALIGN - 1))
+
+struct _reel_arena {
+    struct _reel_arena_block *blocks;
+    void *free_chunks[REEL_ARENA_MAX_CHUNK_BITS + 1];
+    uint64_t num_bytes;
+};
+
+static reel_arena *reel_arena_new(void)
+{
+    return calloc(1, sizeof(reel_arena));
+}
+
+static void reel_arena_free(reel_arena *arena)
+{
+    struct _reel_arena_block *next, *block;
+    if (arena){
+        for (block = arena->blocks; block; block = next){
+            next = block->next;
+            free(block);
+        }
+        free(arena);
+    }
+}
+
+static void *reel_arena_alloc(reel_arena *arena, uint64_t size)
+{
+    struct _reel_arena_block *block = arena->blocks;
+
+    size = (size + REEL_ARENA_ALIGN - 1) & ~(uint64_t)(REEL_ARENA_ALIGN - 1);
+
+    if (!block || block->offset + size > block->size){
+        uint64_t block_size = REEL_ARENA_BLOCK_SIZE;
+
+        /*
+        Large allocations get a block of their own, which is placed
+        behind the current block so that its free space is not wasted.
+        */
+        if (size > block_size / 4)
+            block_size = size;
+        if (!(block = malloc(REEL_ARENA_HEADER_SIZE + block_size)))
+            return NULL;
+        block->size = block_size;
+        block->offset = 0;
+        arena->num_bytes += REEL_ARENA_HEADER_SIZE + block_size;
+
+        if (size == block_size && arena->blocks){
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        }else{
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    block->offset += size;
+    return (char*)block + REEL_ARENA_HEADER_SIZE + block->offset - size;
+}
+
+static void *reel_arena_calloc(reel_arena *arena, uint64_t size)
+{
+    void *p;
+    if ((p = reel_arena_alloc(arena, size)))
+        memset(p, 0, size);
+    return p;
+}
+
+/* allocate 2^bits bytes */
+static void *reel_arena_alloc_chunk(reel_arena *arena, uint32_t bits)
+{
+    void *p;
+    if ((p = arena->free_chunks[bits])){
+        arena->free_chunks[bits] = *(void**)p;
+        return p;
+    }
+    return reel_arena_alloc(arena, 1ULL << bits);
+}
+
+static void reel_arena_free_chunk(reel_arena *arena, void *chunk, uint32_t bits)
+{
+    *(void**)chunk = arena->free_chunks[bits];
+    arena->free_chunks[bits] = chunk;
+}
+
+/* smallest chunk that fits size bytes */
+static inline uint32_t reel_arena_chunk_bits(uint64_t size)
+{
+    if (size <= (1ULL << REEL_ARENA_MIN_CHUNK_BITS))
+        return REEL_ARENA_MIN_CHUNK_BITS;
+    return 64 - __builtin_clzll(size - 1);
+}
+
+static void *reel_arena_alloc_page(reel_arena *arena, reel_table_width width)
+{
+    return reel_arena_alloc_chunk(arena, REEL_TABLE_PAGE_BITS + width);
+}
+
+static void reel_arena_free_page(reel_arena *arena,
+                                 void *page,
+                                 reel_table_width width)
+{
+    reel_arena_free_chunk(arena, page, REEL_TABLE_PAGE_BITS + width);
+}
@@ -0,0 +1,119 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+batches: programs whose patterns only test items of the current event
+against literals and only increment counters and tables by constants,
+like
+
+    if $color $color='blue':
+        inc Blues 1
+        inc Colors[$color] 1
+
+carry no state from one event to the next, so the compiler evaluates
+each pattern over all events of a trail at once instead of event by
+event. The items of the fields involved are copied to columns and a
+single loop over the columns, which the compiler vectorizes, counts the
+events that match each pattern, so that a counter is incremented once
+per trail. Patterns that increment tables evaluate their condition to
+a mask of matching events by a vectorized loop as well, and the table
+is then incremented for each matching event.
+
+Programs that only increment tables, like doc/03-table.rl, are
+evaluated event by event: the table is incremented once per matching
+event either way, so only the cost of the mask is added. Measured on
+03-table, computing the mask first was on par with the scalar loop on
+trails of 30 events (4.95 vs 5.0 ns/event) and about 10% slower on
+trails of 1000 events (5.3-5.9 vs 5.0 ns/event), and coalescing runs of
+equal items before incrementing was twice as slow. Counter patterns,
+which are counted without a per-event update, went from 8.7 to 5.7
+ns/event with 30 events and from 10.4 to 4.7 ns/event with 1000 events.
+
+Kernels are compiled for AVX-512 and AVX2 besides the baseline
+instruction set and the best version for the CPU is picked at load
+time. Trails shorter than REEL_BATCH_MIN_EVENTS are evaluated event by
+event, since filling the columns would cost more than it saves.
+*/
+
+#define REEL_BATCH_MIN_EVENTS 8
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define REEL_BATCH_KERNEL\
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef REEL_BATCH_KERNEL
+#define REEL_BATCH_KERNEL
+#endif
+
+static void reel_batch_free(reel_batch *batch)
+{
+    free(batch->columns);
+    free(batch->mask);
+    memset(batch, 0, sizeof(reel_batch));
+}
+
+/* make room for num_columns columns of num_events, return -1 if out of memory */
+static int reel_batch_reserve(reel_batch *batch,
+                              uint32_t num_columns,
+                              uint64_t num_events)
+{
+    uint64_t new_size;
+    tdb_item *columns;
+    uint8_t *mask;
+
+    if (num_events <= batch->size)
+        return 0;
+    new_size = batch->size * 2 > num_events ? batch->size * 2: num_events;
+    if (!(columns = malloc(num_columns * new_size * sizeof(tdb_item))))
+        return -1;
+    if (!(mask = malloc(new_size))){
+        free(columns);
+        return -1;
+    }
+    reel_batch_free(batch);
+    batch->columns = columns;
+    batch->mask = mask;
+    batch->size = new_size;
+    return 0;
+}
+
+/* copy the items of field to a column, or zeros if the field doesn't exist */
+static const tdb_item *reel_batch_column(reel_batch *batch,
+                                         uint32_t column,
+                                         tdb_field field,
+                                         const tdb_event **events,
+                                         uint64_t num_events)
+{
+    tdb_item *items = &batch->columns[column * batch->size];
+    uint64_t i;
+
+    if (field)
+        for (i = 0; i < num_events; i++)
+            items[i] = events[i]->items[field - 1];
+    else
+        memset(items, 0, num_events * sizeof(tdb_item));
+    return items;
+}
+
+/* inc var[$field] val for the matching events, see reelfunc_inc_tableitem_uint */
+static void reel_batch_table_inc(reel_ctx *ctx,
+                                 reel_var *var,
+                                 const tdb_item *items,
+                                 const uint8_t *mask,
+                                 uint64_t num_events,
+                                 uint64_t val)
+{
+    reel_table *table = (reel_table*)var->value;
+    uint64_t i;
+
+    if (var->table_value_type != REEL_UINT){
+        if (memchr(mask, 1, num_events))
+            ctx->error = REEL_TABLE_MISMATCH;
+    }else if (var->table_field)
+        for (i = 0; i < num_events; i++)
+            if (mask[i])
+                reel_table_inc(ctx, table, tdb_item_val(items[i]), val);
+}
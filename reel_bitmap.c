@@ -0,0 +1,550 @@
+
+#include <stdio.h>
+#include <string.h>
+
+/* compressed bitmaps */
+
+/* log2 of the size of a bitset in bytes */
+#define REEL_BITMAP_BITSET_BITS 13
+
+static inline int reel_bitmap_is_bitset(const reel_bitmap_container *c)
+{
+    return c->cardinality > REEL_BITMAP_ARRAY_MAX;
+}
+
+static inline uint32_t reel_bitmap_values_bits(uint64_t cardinality)
+{
+    if (cardinality > REEL_BITMAP_ARRAY_MAX)
+        return REEL_BITMAP_BITSET_BITS;
+    return reel_arena_chunk_bits(cardinality * sizeof(uint16_t));
+}
+
+static inline uint64_t reel_bitmap_values_size(uint64_t cardinality)
+{
+    if (cardinality > REEL_BITMAP_ARRAY_MAX)
+        return REEL_BITMAP_BITSET_WORDS * sizeof(uint64_t);
+    return cardinality * sizeof(uint16_t);
+}
+
+static reel_bitmap *reel_bitmap_new(reel_arena *arena)
+{
+    reel_bitmap *b;
+    if ((b = reel_arena_calloc(arena, sizeof(reel_bitmap))))
+        b->arena = arena;
+    return b;
+}
+
+/* remove all values, the memory is returned to the arena */
+static void reel_bitmap_reset(reel_bitmap *b)
+{
+    uint64_t i;
+    for (i = 0; i < b->num_containers; i++)
+        reel_arena_free_chunk(b->arena,
+                              b->containers[i].values,
+                              reel_bitmap_values_bits(b->containers[i].cardinality));
+    if (b->containers)
+        reel_arena_free_chunk(b->arena, b->containers, b->containers_bits);
+    b->containers = NULL;
+    b->num_containers = 0;
+    b->containers_bits = 0;
+}
+
+/* index of the first container whose key is not less than key */
+static inline uint64_t reel_bitmap_find(const reel_bitmap *b, uint64_t key)
+{
+    uint64_t lo = 0, hi = b->num_containers;
+
+    /* values are often added in increasing order, e.g. trail ids */
+    if (hi && b->containers[hi - 1].key <= key)
+        return b->containers[hi - 1].key == key ? hi - 1: hi;
+
+    while (lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (b->containers[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static inline uint64_t reel_bitmap_array_find(const uint16_t *values,
+                                              uint64_t num_values,
+                                              uint16_t val)
+{
+    uint64_t lo = 0, hi = num_values;
+
+    if (hi && values[hi - 1] <= val)
+        return values[hi - 1] == val ? hi - 1: hi;
+
+    while (lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (values[mid] < val)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* make room for a container at idx */
+static reel_bitmap_container *reel_bitmap_insert(reel_bitmap *b, uint64_t idx)
+{
+    reel_bitmap_container *dir = b->containers;
+    uint64_t num = b->num_containers;
+    uint32_t bits = reel_arena_chunk_bits((num + 1) * sizeof(reel_bitmap_container));
+
+    if (!dir || bits > b->containers_bits){
+        if (!(dir = reel_arena_alloc_chunk(b->arena, bits)))
+            return NULL;
+        if (b->containers){
+            memcpy(dir, b->containers, idx * sizeof(reel_bitmap_container));
+            memcpy(&dir[idx + 1],
+                   &b->containers[idx],
+                   (num - idx) * sizeof(reel_bitmap_container));
+            reel_arena_free_chunk(b->arena, b->containers, b->containers_bits);
+        }
+        b->containers = dir;
+        b->containers_bits = bits;
+    }else
+        memmove(&dir[idx + 1],
+                &dir[idx],
+                (num - idx) * sizeof(reel_bitmap_container));
+    ++b->num_containers;
+    return &dir[idx];
+}
+
+/* a new bitset with the values of the container */
+static uint64_t *reel_bitmap_to_bitset(reel_arena *arena,
+                                       const reel_bitmap_container *c)
+{
+    uint64_t i, *words;
+    if (!(words = reel_arena_alloc_chunk(arena, REEL_BITMAP_BITSET_BITS)))
+        return NULL;
+    if (reel_bitmap_is_bitset(c))
+        memcpy(words, c->values, REEL_BITMAP_BITSET_WORDS * sizeof(uint64_t));
+    else{
+        const uint16_t *values = (const uint16_t*)c->values;
+        memset(words, 0, REEL_BITMAP_BITSET_WORDS * sizeof(uint64_t));
+        for (i = 0; i < c->cardinality; i++)
+            words[values[i] >> 6] |= 1ULL << (values[i] & 63);
+    }
+    return words;
+}
+
+/* a new array with the values of a bitset */
+static uint16_t *reel_bitmap_to_array(reel_arena *arena,
+                                      const uint64_t *words,
+                                      uint64_t cardinality)
+{
+    uint64_t i, n = 0;
+    uint16_t *values;
+    if (!(values = reel_arena_alloc_chunk(arena,
+                                          reel_bitmap_values_bits(cardinality))))
+        return NULL;
+    for (i = 0; i < REEL_BITMAP_BITSET_WORDS; i++){
+        uint64_t w = words[i];
+        while (w){
+            values[n++] = (i << 6) | __builtin_ctzll(w);
+            w &= w - 1;
+        }
+    }
+    return values;
+}
+
+/* return 1 if val was added, 0 if it existed and -1 if out of memory */
+static int reel_bitmap_container_add(reel_arena *arena,
+                                     reel_bitmap_container *c,
+                                     uint16_t val)
+{
+    uint16_t *values = (uint16_t*)c->values;
+    uint64_t *words, i;
+
+    if (reel_bitmap_is_bitset(c)){
+        words = (uint64_t*)c->values;
+        if (words[val >> 6] & (1ULL << (val & 63)))
+            return 0;
+    }else{
+        uint32_t bits = reel_bitmap_values_bits(c->cardinality);
+
+        i = reel_bitmap_array_find(values, c->cardinality, val);
+        if (i < c->cardinality && values[i] == val)
+            return 0;
+
+        if (c->cardinality < REEL_BITMAP_ARRAY_MAX){
+            uint32_t new_bits = reel_bitmap_values_bits(c->cardinality + 1);
+            if (new_bits != bits){
+                uint16_t *new_values;
+                if (!(new_values = reel_arena_alloc_chunk(arena, new_bits)))
+                    return -1;
+                memcpy(new_values, values, i * sizeof(uint16_t));
+                memcpy(&new_values[i + 1],
+                       &values[i],
+                       (c->cardinality - i) * sizeof(uint16_t));
+                reel_arena_free_chunk(arena, values, bits);
+                c->values = values = new_values;
+            }else
+                memmove(&values[i + 1],
+                        &values[i],
+                        (c->cardinality - i) * sizeof(uint16_t));
+            values[i] = val;
+            ++c->cardinality;
+            return 1;
+        }
+
+        /* a full array becomes a bitset */
+        if (!(words = reel_bitmap_to_bitset(arena, c)))
+            return -1;
+        reel_arena_free_chunk(arena, values, bits);
+        c->values = words;
+    }
+    words[val >> 6] |= 1ULL << (val & 63);
+    ++c->cardinality;
+    return 1;
+}
+
+/* return 1 if val was added, 0 if it existed and -1 if out of memory */
+static int reel_bitmap_add(reel_bitmap *b, uint64_t val)
+{
+    const uint64_t key = val >> 16;
+    uint64_t i = reel_bitmap_find(b, key);
+    reel_bitmap_container *c;
+    uint16_t *values;
+
+    if (i < b->num_containers && b->containers[i].key == key)
+        return reel_bitmap_container_add(b->arena, &b->containers[i], val);
+
+    if (!(values = reel_arena_alloc_chunk(b->arena, reel_bitmap_values_bits(1))))
+        return -1;
+    if (!(c = reel_bitmap_insert(b, i))){
+        reel_arena_free_chunk(b->arena, values, reel_bitmap_values_bits(1));
+        return -1;
+    }
+    values[0] = (uint16_t)val;
+    c->key = key;
+    c->cardinality = 1;
+    c->values = values;
+    return 1;
+}
+
+static int reel_bitmap_container_copy(reel_arena *arena,
+                                      reel_bitmap_container *dst,
+                                      const reel_bitmap_container *src)
+{
+    void *values;
+    if (!(values = reel_arena_alloc_chunk(arena,
+                                          reel_bitmap_values_bits(src->cardinality))))
+        return -1;
+    memcpy(values, src->values, reel_bitmap_values_size(src->cardinality));
+    dst->key = src->key;
+    dst->cardinality = src->cardinality;
+    dst->values = values;
+    return 0;
+}
+
+static int reel_bitmap_container_union(reel_arena *arena,
+                                       reel_bitmap_container *c,
+                                       const reel_bitmap_container *src)
+{
+    uint64_t i, j, n = 0;
+
+    if (!reel_bitmap_is_bitset(c) &&
+        !reel_bitmap_is_bitset(src) &&
+        c->cardinality + src->cardinality <= REEL_BITMAP_ARRAY_MAX){
+
+        /* merge two small arrays */
+        uint16_t merged[REEL_BITMAP_ARRAY_MAX];
+        const uint16_t *a = (const uint16_t*)c->values;
+        const uint16_t *b = (const uint16_t*)src->values;
+        uint32_t bits = reel_bitmap_values_bits(c->cardinality);
+
+        for (i = 0, j = 0; i < c->cardinality || j < src->cardinality;)
+            if (j == src->cardinality || (i < c->cardinality && a[i] < b[j]))
+                merged[n++] = a[i++];
+            else if (i == c->cardinality || b[j] < a[i])
+                merged[n++] = b[j++];
+            else{
+                merged[n++] = a[i++];
+                ++j;
+            }
+        if (reel_bitmap_values_bits(n) != bits){
+            void *values;
+            if (!(values = reel_arena_alloc_chunk(arena, reel_bitmap_values_bits(n))))
+                return -1;
+            reel_arena_free_chunk(arena, c->values, bits);
+            c->values = values;
+        }
+        memcpy(c->values, merged, n * sizeof(uint16_t));
+        c->cardinality = n;
+    }else{
+        uint64_t *words = (uint64_t*)c->values;
+        void *values;
+
+        if (!reel_bitmap_is_bitset(c) &&
+            !(words = reel_bitmap_to_bitset(arena, c)))
+            return -1;
+        if (reel_bitmap_is_bitset(src)){
+            const uint64_t *src_words = (const uint64_t*)src->values;
+            for (i = 0; i < REEL_BITMAP_BITSET_WORDS; i++){
+                words[i] |= src_words[i];
+                n += __builtin_popcountll(words[i]);
+            }
+        }else{
+            const uint16_t *src_values = (const uint16_t*)src->values;
+            for (i = 0; i < src->cardinality; i++)
+                words[src_values[i] >> 6] |= 1ULL << (src_values[i] & 63);
+            for (i = 0; i < REEL_BITMAP_BITSET_WORDS; i++)
+                n += __builtin_popcountll(words[i]);
+        }
+
+        /*
+        Overlapping arrays may fit in an array after all. Then c is an
+        array and words is a new bitset.
+        */
+        values = words;
+        if (n <= REEL_BITMAP_ARRAY_MAX){
+            values = reel_bitmap_to_array(arena, words, n);
+            reel_arena_free_chunk(arena, words, REEL_BITMAP_BITSET_BITS);
+            if (!values)
+                return -1;
+        }
+        if (values != c->values)
+            reel_arena_free_chunk(arena,
+                                  c->values,
+                                  reel_bitmap_values_bits(c->cardinality));
+        c->values = values;
+        c->cardinality = n;
+    }
+    return 0;
+}
+
+/* add all values of src to dst, return -1 if out of memory */
+static int reel_bitmap_union(reel_bitmap *dst, const reel_bitmap *src)
+{
+    const uint64_t num = dst->num_containers + src->num_containers;
+    const uint32_t bits = reel_arena_chunk_bits(num * sizeof(reel_bitmap_container));
+    uint64_t i = 0, j = 0, n = 0;
+    reel_bitmap_container *dir;
+    int ret = 0;
+
+    if (!src->num_containers)
+        return 0;
+    if (!(dir = reel_arena_alloc_chunk(dst->arena, bits)))
+        return -1;
+
+    while (i < dst->num_containers || j < src->num_containers){
+        if (j == src->num_containers ||
+            (i < dst->num_containers &&
+             dst->containers[i].key < src->containers[j].key))
+            dir[n++] = dst->containers[i++];
+        else if (i == dst->num_containers ||
+                 src->containers[j].key < dst->containers[i].key){
+            if (reel_bitmap_container_copy(dst->arena,
+                                           &dir[n],
+                                           &src->containers[j++])){
+                ret = -1;
+                break;
+            }
+            ++n;
+        }else{
+            dir[n] = dst->containers[i++];
+            if (reel_bitmap_container_union(dst->arena,
+                                            &dir[n++],
+                                            &src->containers[j++])){
+                ret = -1;
+                break;
+            }
+        }
+    }
+    /* on failure, keep what is left of dst */
+    while (i < dst->num_containers)
+        dir[n++] = dst->containers[i++];
+
+    if (dst->containers)
+        reel_arena_free_chunk(dst->arena, dst->containers, dst->containers_bits);
+    dst->containers = dir;
+    dst->containers_bits = bits;
+    dst->num_containers = n;
+    return ret;
+}
+
+static reel_bitmap *reel_bitmap_copy(reel_arena *arena, const reel_bitmap *src)
+{
+    reel_bitmap *b;
+    if (!(b = reel_bitmap_new(arena)))
+        return NULL;
+    if (reel_bitmap_union(b, src))
+        return NULL;
+    return b;
+}
+
+/* add src to the bitmap of var, return -1 if out of memory */
+static int reel_bitmap_merge_var(reel_arena *arena,
+                                 reel_var *var,
+                                 const reel_bitmap *src)
+{
+    reel_bitmap *dst = (reel_bitmap*)var->value;
+    if (!src)
+        return 0;
+    if (!dst){
+        if (!(dst = reel_bitmap_new(arena)))
+            return -1;
+        var->value = (uintptr_t)dst;
+    }
+    return reel_bitmap_union(dst, src);
+}
+
+static uint64_t reel_bitmap_cardinality(const reel_bitmap *b)
+{
+    uint64_t i, n = 0;
+    if (b)
+        for (i = 0; i < b->num_containers; i++)
+            n += b->containers[i].cardinality;
+    return n;
+}
+
+static uint64_t reel_bitmap_container_and_count(const reel_bitmap_container *a,
+                                                const reel_bitmap_container *b)
+{
+    uint64_t i, j, n = 0;
+
+    if (reel_bitmap_is_bitset(a) && reel_bitmap_is_bitset(b)){
+        const uint64_t *x = (const uint64_t*)a->values;
+        const uint64_t *y = (const uint64_t*)b->values;
+        for (i = 0; i < REEL_BITMAP_BITSET_WORDS; i++)
+            n += __builtin_popcountll(x[i] & y[i]);
+    }else if (reel_bitmap_is_bitset(a) || reel_bitmap_is_bitset(b)){
+        const reel_bitmap_container *s = reel_bitmap_is_bitset(a) ? a: b;
+        const reel_bitmap_container *t = s == a ? b: a;
+        const uint64_t *words = (const uint64_t*)s->values;
+        const uint16_t *values = (const uint16_t*)t->values;
+        for (i = 0; i < t->cardinality; i++)
+            n += (words[values[i] >> 6] >> (values[i] & 63)) & 1;
+    }else{
+        const uint16_t *x = (const uint16_t*)a->values;
+        const uint16_t *y = (const uint16_t*)b->values;
+        for (i = 0, j = 0; i < a->cardinality && j < b->cardinality;)
+            if (x[i] < y[j])
+                ++i;
+            else if (y[j] < x[i])
+                ++j;
+            else{
+                ++n;
+                ++i;
+                ++j;
+            }
+    }
+    return n;
+}
+
+/* number of values in both bitmaps */
+static uint64_t reel_bitmap_intersection_cardinality(const reel_bitmap *a,
+                                                     const reel_bitmap *b)
+{
+    uint64_t i = 0, j = 0, n = 0;
+
+    if (!(a && b))
+        return 0;
+
+    while (i < a->num_containers && j < b->num_containers){
+        if (a->containers[i].key < b->containers[j].key)
+            ++i;
+        else if (b->containers[j].key < a->containers[i].key)
+            ++j;
+        else
+            n += reel_bitmap_container_and_count(&a->containers[i++],
+                                                 &b->containers[j++]);
+    }
+    return n;
+}
+
+/*
+Bitmaps are serialized as the number of containers followed by the key,
+the cardinality and the values of each container.
+*/
+static int reel_bitmap_write(FILE *out, const reel_bitmap *b)
+{
+    uint64_t i;
+    if (fwrite(&b->num_containers, sizeof(uint64_t), 1, out) != 1)
+        return -1;
+    for (i = 0; i < b->num_containers; i++){
+        const reel_bitmap_container *c = &b->containers[i];
+        if (fwrite(&c->key, sizeof(uint64_t), 1, out) != 1 ||
+            fwrite(&c->cardinality, sizeof(uint64_t), 1, out) != 1 ||
+            fwrite(c->values,
+                   reel_bitmap_values_size(c->cardinality),
+                   1,
+                   out) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+/* read a serialized bitmap to an empty bitmap */
+static int reel_bitmap_read(FILE *in, reel_bitmap *b)
+{
+    uint64_t i, num;
+    if (fread(&num, sizeof(uint64_t), 1, in) != 1)
+        return -1;
+    for (i = 0; i < num; i++){
+        reel_bitmap_container *c;
+        uint64_t key, cardinality;
+        void *values;
+
+        if (fread(&key, sizeof(uint64_t), 1, in) != 1 ||
+            fread(&cardinality, sizeof(uint64_t), 1, in) != 1)
+            return -1;
+        if (!cardinality || cardinality > (1 << 16) ||
+            (i && key <= b->containers[i - 1].key))
+            return -1;
+        if (!(values = reel_arena_alloc_chunk(b->arena,
+                                              reel_bitmap_values_bits(cardinality))))
+            return -1;
+        if (fread(values, reel_bitmap_values_size(cardinality), 1, in) != 1 ||
+            !(c = reel_bitmap_insert(b, i))){
+            reel_arena_free_chunk(b->arena,
+                                  values,
+                                  reel_bitmap_values_bits(cardinality));
+            return -1;
+        }
+        c->key = key;
+        c->cardinality = cardinality;
+        c->values = values;
+    }
+    return 0;
+}
+
+static inline int reel_bitmap_add_var(reel_ctx *ctx, reel_var *var, uint64_t val)
+{
+    reel_bitmap *b = (reel_bitmap*)var->value;
+    int ret;
+
+    if (!b){
+        if (!(b = reel_bitmap_new(ctx->arena))){
+            ctx->error = REEL_OUT_OF_MEMORY;
+            return 0;
+        }
+        var->value = (uintptr_t)b;
+    }
+    if ((ret = reel_bitmap_add(b, val)) < 0){
+        ctx->error = REEL_OUT_OF_MEMORY;
+        return 0;
+    }
+    return ret;
+}
+
+static inline int reelfunc_add_bitmapptr_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t val){
+    return reel_bitmap_add_var(ctx, var, val);
+}
+
+static inline int reelfunc_add_bitmapptr_uint(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t val){
+    return reel_bitmap_add_var(ctx, var, val);
+}
+
+static inline int reelfunc_add_bitmapptr_uintptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *val){
+    return reel_bitmap_add_var(ctx, var, *val);
+}
+
+static inline int reelfunc_add_bitmapptr_itemptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *val){
+    return reel_bitmap_add_var(ctx, var, *val);
+}
@@ -0,0 +1,337 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+/* fork keys */
+
+#define REEL_FORK_MIN_TABLE_SIZE 64
+
+/* largest lexicon that gets a direct index of children */
+#define REEL_FORK_MAX_INDEX_SIZE (1 << 20)
+
+/* marks fields that were considered for an index but didn't get one */
+static void *reel_fork_no_index[1];
+
+static inline uint64_t reel_fork_hash(uint64_t key)
+{
+    key *= 0x9e3779b97f4a7c15ULL;
+    return key ^ (key >> 32);
+}
+
+static inline void **reel_fork_index_slot(const reel_fork_map *map,
+                                          uint64_t key)
+{
+    tdb_field field = tdb_item_field(key);
+    uint64_t val = tdb_item_val(key);
+
+    if (field < map->num_fields &&
+        val < map->num_items[field] &&
+        tdb_make_item(field, val) == key)
+        return &map->items[field][val];
+    return NULL;
+}
+
+static inline void *reel_fork_get(const reel_fork_map *map, uint64_t key)
+{
+    void **slot;
+    uint64_t i;
+
+    if ((slot = reel_fork_index_slot(map, key)))
+        return *slot;
+    if (map->table)
+        for (i = reel_fork_hash(key) & map->table_mask;
+             map->table[i].child;
+             i = (i + 1) & map->table_mask)
+            if (map->table[i].key == key)
+                return map->table[i].child;
+    return NULL;
+}
+
+static void reel_fork_hash_set(reel_fork_entry *table,
+                               uint64_t mask,
+                               uint64_t key,
+                               void *child)
+{
+    uint64_t i = reel_fork_hash(key) & mask;
+    while (table[i].child)
+        i = (i + 1) & mask;
+    table[i].key = key;
+    table[i].child = child;
+}
+
+static int reel_fork_hash_insert(reel_fork_map *map, uint64_t key, void *child)
+{
+    uint64_t i, size = map->table ? map->table_mask + 1: 0;
+
+    /* keep the load factor at most 1/2 so that probe chains stay short */
+    if ((map->num_hashed + 1) * 2 > size){
+        reel_fork_entry *table;
+        uint64_t new_size = size ? size * 2: REEL_FORK_MIN_TABLE_SIZE;
+
+        if (!(table = calloc(new_size, sizeof(reel_fork_entry))))
+            return -1;
+        for (i = 0; i < size; i++)
+            if (map->table[i].child)
+                reel_fork_hash_set(table,
+                                   new_size - 1,
+                                   map->table[i].key,
+                                   map->table[i].child);
+        free(map->table);
+        map->table = table;
+        map->table_mask = new_size - 1;
+    }
+    reel_fork_hash_set(map->table, map->table_mask, key, child);
+    ++map->num_hashed;
+    return 0;
+}
+
+/* add a new child, key must not exist in map */
+static int reel_fork_put(reel_fork_map *map, uint64_t key, void *child)
+{
+    void **slot;
+
+    if (map->num_children == map->children_size){
+        uint64_t size = map->children_size ? map->children_size * 2: 16;
+        reel_fork_entry *children;
+        if (!(children = realloc(map->children,
+                                 size * sizeof(reel_fork_entry))))
+            return -1;
+        map->children = children;
+        map->children_size = size;
+    }
+    if ((slot = reel_fork_index_slot(map, key)))
+        *slot = child;
+    else if (reel_fork_hash_insert(map, key, child))
+        return -1;
+
+    map->children[map->num_children].key = key;
+    map->children[map->num_children++].child = child;
+    return 0;
+}
+
+/*
+Create a direct index for children keyed by items of the given field,
+unless the lexicon of the field is too large. Existing children of the
+field are moved from the hash table to the index.
+*/
+static void reel_fork_index_field(reel_fork_map *map,
+                                  const tdb *db,
+                                  tdb_field field)
+{
+    uint64_t i, num_moved = 0;
+    uint64_t size = tdb_lexicon_size(db, field);
+    void **items;
+
+    if (!map->items){
+        uint64_t num_fields = tdb_num_fields(db);
+        if (!(map->items = calloc(num_fields, sizeof(void**))))
+            return;
+        if (!(map->num_items = calloc(num_fields, sizeof(uint64_t)))){
+            free(map->items);
+            map->items = NULL;
+            return;
+        }
+        map->num_fields = num_fields;
+    }
+    if (field >= map->num_fields || map->items[field])
+        return;
+
+    if (size > REEL_FORK_MAX_INDEX_SIZE ||
+        !(items = calloc(size, sizeof(void*)))){
+        map->items[field] = reel_fork_no_index;
+        return;
+    }
+    map->items[field] = items;
+    map->num_items[field] = size;
+
+    /* children of other fields are already indexed or hashed */
+    for (i = 0; i < map->num_children; i++){
+        void **slot;
+        if (tdb_item_field(map->children[i].key) != field)
+            continue;
+        if ((slot = reel_fork_index_slot(map, map->children[i].key))){
+            *slot = map->children[i].child;
+            ++num_moved;
+        }
+    }
+    if (num_moved && map->table){
+        /* rebuild the hash table without the moved keys */
+        memset(map->table, 0, (map->table_mask + 1) * sizeof(reel_fork_entry));
+        map->num_hashed = 0;
+        for (i = 0; i < map->num_children; i++)
+            if (!reel_fork_index_slot(map, map->children[i].key)){
+                reel_fork_hash_set(map->table,
+                                   map->table_mask,
+                                   map->children[i].key,
+                                   map->children[i].child);
+                ++map->num_hashed;
+            }
+    }
+}
+
+static inline void reel_fork_index(reel_fork_map *map,
+                                   const tdb *db,
+                                   uint64_t item)
+{
+    tdb_field field = tdb_item_field(item);
+    if (!map->items || (field < map->num_fields && !map->items[field]))
+        reel_fork_index_field(map, db, field);
+}
+
+static int reel_fork_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const reel_fork_entry*)a)->key;
+    uint64_t y = ((const reel_fork_entry*)b)->key;
+    return x < y ? -1: x > y;
+}
+
+/* return children sorted by key, the caller must free the array */
+static reel_fork_entry *reel_fork_sorted(const reel_fork_map *map)
+{
+    reel_fork_entry *sorted;
+    if (!(sorted = malloc((map->num_children + 1) * sizeof(reel_fork_entry))))
+        return NULL;
+    if (map->num_children)
+        memcpy(sorted, map->children, map->num_children * sizeof(reel_fork_entry));
+    qsort(sorted, map->num_children, sizeof(reel_fork_entry), reel_fork_cmp);
+    return sorted;
+}
+
+static void reel_fork_free(reel_fork_map *map)
+{
+    uint64_t i;
+    for (i = 0; i < map->num_fields; i++)
+        if (map->items[i] != reel_fork_no_index)
+            free(map->items[i]);
+    free(map->items);
+    free(map->num_items);
+    free(map->table);
+    free(map->children);
+    memset(map, 0, sizeof(reel_fork_map));
+}
+
+/* partitions */
+
+static inline uint64_t *reel_partition_slot(const reel_partition *p, tdb_item key)
+{
+    uint64_t i = reel_fork_hash(key) & p->index_mask;
+    while (p->index[i] && p->groups[p->index[i] - 1].key != key)
+        i = (i + 1) & p->index_mask;
+    return &p->index[i];
+}
+
+static reel_partition_group *reel_partition_add(reel_partition *p, tdb_item key)
+{
+    uint64_t i, *slot, size = p->index ? p->index_mask + 1: 0;
+
+    if ((p->num_groups + 1) * 2 > size){
+        uint64_t new_size = size ? size * 2: REEL_FORK_MIN_TABLE_SIZE;
+        uint64_t *index;
+        if (!(index = calloc(new_size, sizeof(uint64_t))))
+            return NULL;
+        free(p->index);
+        p->index = index;
+        p->index_mask = new_size - 1;
+        for (i = 0; i < p->num_groups; i++)
+            *reel_partition_slot(p, p->groups[i].key) = i + 1;
+    }
+    if (p->num_groups == p->groups_size){
+        uint64_t new_size = p->groups_size ? p->groups_size * 2: 16;
+        reel_partition_group *groups;
+        if (!(groups = realloc(p->groups, new_size * sizeof(reel_partition_group))))
+            return NULL;
+        p->groups = groups;
+        p->groups_size = new_size;
+    }
+    slot = reel_partition_slot(p, key);
+    p->groups[p->num_groups].key = key;
+    p->groups[p->num_groups].count = 0;
+    *slot = ++p->num_groups;
+    return &p->groups[p->num_groups - 1];
+}
+
+static int reel_partition_build(reel_partition *p,
+                                tdb_field field,
+                                const tdb_event **events,
+                                uint64_t num_events)
+{
+    uint64_t i, offset = 0;
+
+    /*
+    Clear the index of the previous trail in the reverse order of
+    insertion, so that probes never cross a cleared slot.
+    */
+    while (p->num_groups){
+        --p->num_groups;
+        *reel_partition_slot(p, p->groups[p->num_groups].key) = 0;
+    }
+    p->generation = 0;
+
+    if (num_events > p->events_size){
+        const tdb_event **new_events;
+        if (!(new_events = realloc(p->events, num_events * sizeof(tdb_event*))))
+            return -1;
+        p->events = new_events;
+        p->events_size = num_events;
+    }
+    for (i = 0; i < num_events; i++){
+        tdb_item key = events[i]->items[field - 1];
+        uint64_t idx = p->index ? *reel_partition_slot(p, key): 0;
+        reel_partition_group *group;
+        if (idx)
+            group = &p->groups[idx - 1];
+        else if (!(group = reel_partition_add(p, key)))
+            return -1;
+        ++group->count;
+    }
+    for (i = 0; i < p->num_groups; i++){
+        p->groups[i].offset = offset;
+        offset += p->groups[i].count;
+        p->groups[i].count = 0;
+    }
+    /* events keep their order within a group */
+    for (i = 0; i < num_events; i++){
+        uint64_t idx = *reel_partition_slot(p, events[i]->items[field - 1]);
+        reel_partition_group *group = &p->groups[idx - 1];
+        p->events[group->offset + group->count++] = events[i];
+    }
+    p->field = field;
+    return 0;
+}
+
+/*
+Return the events of the current trail whose item of field equals the
+item of ev, in order, and set num_events to their number. The compiler
+uses this for children that provably act only on events of their own
+key. The grouping is built once per trail, on the first fork. If field
+is zero or out of memory, all events are returned.
+*/
+static const tdb_event **reel_fork_group(reel_ctx *ctx,
+                                         tdb_field field,
+                                         const tdb_event *ev,
+                                         const tdb_event **events,
+                                         uint64_t *num_events)
+{
+    reel_ctx *root = ctx->root;
+    reel_partition *p = &root->partition;
+    const reel_partition_group *group;
+
+    if (!field || ctx != root)
+        return events;
+    if (p->generation != root->generation || p->field != field){
+        if (reel_partition_build(p, field, events, *num_events))
+            return events;
+        p->generation = root->generation;
+    }
+    group = &p->groups[*reel_partition_slot(p, ev->items[field - 1]) - 1];
+    *num_events = group->count;
+    return &p->events[group->offset];
+}
+
+static void reel_partition_free(reel_partition *p)
+{
+    free(p->events);
+    free(p->groups);
+    free(p->index);
+    memset(p, 0, sizeof(reel_partition));
+}
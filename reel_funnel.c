@@ -0,0 +1,169 @@
+
+#include <string.h>
+
+/*
+funnels: the generated code evaluates each funnel in a single pass over
+the events of a trail. For each event it computes a mask of the steps
+that the event matches and passes it to reel_funnel_advance.
+
+An instance of the funnel is the time when it started, i.e. when the
+first step happened, and the time when it reached its current step. For
+each step we keep the instances that are not dominated by another one
+that started later and reached the step later, since those can't do
+worse in any window. Without windows only one instance is kept for
+each step. With windows, overlapping instances are tracked up to
+REEL_FUNNEL_MAX_INSTANCES per step, after which the instance that
+reached the step first is dropped.
+*/
+
+#define REEL_FUNNEL_MAX_INSTANCES 16
+
+typedef struct {
+    uint64_t start;
+    uint64_t reached;
+} reel_funnel_instance;
+
+typedef struct {
+    const reel_funnel *funnel;
+    uint32_t reached;
+    /* instances by step, sorted by reached and, descending, by start */
+    uint32_t num_instances[REEL_FUNNEL_MAX_STEPS];
+    reel_funnel_instance instances[REEL_FUNNEL_MAX_STEPS][REEL_FUNNEL_MAX_INSTANCES];
+} reel_funnel_state;
+
+static inline void reel_funnel_init(reel_funnel_state *state,
+                                    const reel_funnel *funnel)
+{
+    state->funnel = funnel;
+    state->reached = 0;
+    memset(state->num_instances, 0, funnel->num_steps * sizeof(uint32_t));
+}
+
+/* drop instances of a step that have run out of time at tstamp */
+static inline void reel_funnel_expire(reel_funnel_state *state,
+                                      uint32_t step,
+                                      uint64_t window,
+                                      uint64_t tstamp)
+{
+    reel_funnel_instance *instances = state->instances[step];
+    uint32_t i = 0, n = state->num_instances[step];
+    const uint64_t total = state->funnel->window;
+
+    /* instances that started first are at the end */
+    if (total)
+        while (n && tstamp - instances[n - 1].start > total)
+            --n;
+    /* instances that reached the step first are at the beginning */
+    if (window)
+        while (i < n && tstamp - instances[i].reached > window)
+            ++i;
+    if (i)
+        memmove(instances, &instances[i], (n - i) * sizeof(reel_funnel_instance));
+    state->num_instances[step] = n - i;
+}
+
+static inline void reel_funnel_push(reel_funnel_state *state,
+                                    uint32_t step,
+                                    uint64_t start,
+                                    uint64_t tstamp)
+{
+    reel_funnel_instance *instances = state->instances[step];
+    uint32_t n = state->num_instances[step];
+
+    /* the new instance dominates those that started no later */
+    while (n && instances[n - 1].start <= start)
+        --n;
+    if (n == REEL_FUNNEL_MAX_INSTANCES){
+        memmove(instances, &instances[1], (n - 1) * sizeof(reel_funnel_instance));
+        --n;
+    }
+    instances[n].start = start;
+    instances[n].reached = tstamp;
+    state->num_instances[step] = n + 1;
+}
+
+/*
+Advance instances with an event at tstamp that matches the given steps.
+Return 1 when the last step has been reached.
+*/
+static inline int reel_funnel_advance(reel_funnel_state *state,
+                                      uint64_t steps,
+                                      uint64_t tstamp)
+{
+    const reel_funnel *funnel = state->funnel;
+    uint32_t step = funnel->num_steps;
+
+    /* later steps first, so that an event advances an instance once */
+    while (--step){
+        if (!(steps & (1ULL << step)))
+            continue;
+        reel_funnel_expire(state, step - 1, funnel->step_windows[step], tstamp);
+        if (state->num_instances[step - 1]){
+            /* the first instance started last */
+            reel_funnel_push(state,
+                             step,
+                             state->instances[step - 1][0].start,
+                             tstamp);
+            if (step + 1 > state->reached)
+                state->reached = step + 1;
+        }
+    }
+    if (steps & 1){
+        reel_funnel_push(state, 0, tstamp, tstamp);
+        if (!state->reached)
+            state->reached = 1;
+    }
+    return state->reached == funnel->num_steps;
+}
+
+/* add the trail to the counts of the steps it reached */
+static inline void reel_funnel_finish(reel_ctx *ctx,
+                                      reel_var *var,
+                                      const reel_funnel_state *state)
+{
+    uint64_t *counts = (uint64_t*)var->value;
+    uint32_t i;
+
+    if (!state->reached)
+        return;
+    if (!counts){
+        if (!(counts = reel_arena_calloc(ctx->arena,
+                                         var->funnel->num_steps * sizeof(uint64_t)))){
+            ctx->error = REEL_OUT_OF_MEMORY;
+            return;
+        }
+        var->value = (uintptr_t)counts;
+    }
+    for (i = 0; i < state->reached; i++)
+        ++counts[i];
+}
+
+static uint64_t *reel_funnel_copy(reel_arena *arena,
+                                  const reel_var *var,
+                                  const uint64_t *src)
+{
+    uint64_t *counts;
+    if ((counts = reel_arena_alloc(arena, var->funnel->num_steps * sizeof(uint64_t))))
+        memcpy(counts, src, var->funnel->num_steps * sizeof(uint64_t));
+    return counts;
+}
+
+/* add the counts of src to var, return -1 if out of memory */
+static int reel_funnel_merge_var(reel_arena *arena,
+                                 reel_var *var,
+                                 const uint64_t *src)
+{
+    uint64_t *counts = (uint64_t*)var->value;
+    uint32_t i;
+
+    if (!src)
+        return 0;
+    if (!counts){
+        if (!(counts = reel_funnel_copy(arena, var, src)))
+            return -1;
+        var->value = (uintptr_t)counts;
+    }else
+        for (i = 0; i < var->funnel->num_steps; i++)
+            counts[i] += src[i];
+    return 0;
+}
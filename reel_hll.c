@@ -0,0 +1,137 @@
+
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* HyperLogLog sketches */
+
+static inline uint64_t reel_hll_hash(uint64_t x)
+{
+    /* the finalizer of MurmurHash3, seeded so that zero doesn't hash to zero */
+    x ^= 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+static reel_hll *reel_hll_new(reel_arena *arena, const reel_hll *src)
+{
+    reel_hll *hll;
+    if ((hll = reel_arena_alloc(arena, sizeof(reel_hll)))){
+        if (src)
+            memcpy(hll, src, sizeof(reel_hll));
+        else
+            memset(hll, 0, sizeof(reel_hll));
+    }
+    return hll;
+}
+
+/* return 1 if the sketch changed */
+static inline int reel_hll_add(reel_ctx *ctx, reel_var *var, uint64_t val)
+{
+    const uint64_t h = reel_hll_hash(val);
+    const uint64_t idx = h >> (64 - REEL_HLL_BITS);
+    const uint8_t rank = __builtin_clzll((h << REEL_HLL_BITS) |
+                                         (1ULL << (REEL_HLL_BITS - 1))) + 1;
+    reel_hll *hll = (reel_hll*)var->value;
+
+    if (!hll){
+        if (!(hll = reel_hll_new(ctx->arena, NULL))){
+            ctx->error = REEL_OUT_OF_MEMORY;
+            return 0;
+        }
+        var->value = (uintptr_t)hll;
+    }
+    if (hll->registers[idx] < rank){
+        hll->registers[idx] = rank;
+        return 1;
+    }
+    return 0;
+}
+
+/* the union of two sketches is their register-wise maximum */
+static void reel_hll_merge(reel_hll *dst, const reel_hll *src)
+{
+    uint64_t i;
+#ifdef __SSE2__
+    for (i = 0; i < REEL_HLL_SIZE; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i*)&dst->registers[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&src->registers[i]);
+        _mm_storeu_si128((__m128i*)&dst->registers[i], _mm_max_epu8(a, b));
+    }
+#elif defined(__ARM_NEON)
+    for (i = 0; i < REEL_HLL_SIZE; i += 16)
+        vst1q_u8(&dst->registers[i],
+                 vmaxq_u8(vld1q_u8(&dst->registers[i]),
+                          vld1q_u8(&src->registers[i])));
+#else
+    for (i = 0; i < REEL_HLL_SIZE; i++)
+        if (src->registers[i] > dst->registers[i])
+            dst->registers[i] = src->registers[i];
+#endif
+}
+
+/* add src to the sketch of var, return -1 if out of memory */
+static int reel_hll_merge_var(reel_arena *arena,
+                              reel_var *var,
+                              const reel_hll *src)
+{
+    reel_hll *dst = (reel_hll*)var->value;
+    if (!src)
+        return 0;
+    if (!dst){
+        if (!(dst = reel_hll_new(arena, src)))
+            return -1;
+        var->value = (uintptr_t)dst;
+    }else
+        reel_hll_merge(dst, src);
+    return 0;
+}
+
+/*
+Estimate the number of distinct values, using linear counting for small
+cardinalities. Hashes are 64 bits, so no correction is needed for large
+cardinalities.
+*/
+static uint64_t reel_hll_estimate(const reel_hll *hll)
+{
+    const double m = REEL_HLL_SIZE;
+    double est, sum = 0;
+    uint64_t i, zeros = 0;
+
+    if (!hll)
+        return 0;
+
+    for (i = 0; i < REEL_HLL_SIZE; i++){
+        sum += 1.0 / (double)(1ULL << hll->registers[i]);
+        zeros += !hll->registers[i];
+    }
+    est = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+    if (est <= 2.5 * m && zeros)
+        est = m * log(m / zeros);
+    return (uint64_t)(est + 0.5);
+}
+
+static inline int reelfunc_add_hllptr_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t val){
+    return reel_hll_add(ctx, var, val);
+}
+
+static inline int reelfunc_add_hllptr_uint(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t val){
+    return reel_hll_add(ctx, var, val);
+}
+
+static inline int reelfunc_add_hllptr_uintptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *val){
+    return reel_hll_add(ctx, var, *val);
+}
+
+static inline int reelfunc_add_hllptr_itemptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *val){
+    return reel_hll_add(ctx, var, *val);
+}
@@ -0,0 +1,181 @@
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+identities: a dictionary of item tuples to ids shared by a root context,
+its clones and their children, so that a tuple gets the same id in all
+threads. Tuples of one and two items are stored in tables of their own,
+longer tuples are padded with zeros to MAX_ID_ITEMS and followed by
+their number of items, so that a tuple ending with zero items doesn't
+share an id with a shorter one. Each table is split in shards that are
+locked independently.
+*/
+
+#define MAX_ID_ITEMS 6
+#define REEL_ID_SHARD_BITS 6
+#define REEL_ID_NUM_SHARDS (1 << REEL_ID_SHARD_BITS)
+#define REEL_ID_MIN_SHARD_SIZE 64
+
+typedef enum {
+    REEL_ID_ONE = 0,
+    REEL_ID_TWO = 1,
+    REEL_ID_MANY = 2
+} reel_id_class;
+
+static const uint32_t reel_id_widths[] = {1, 2, MAX_ID_ITEMS + 1};
+
+typedef struct {
+    pthread_mutex_t lock;
+    /* entries of width items followed by the id, id 0 marks free entries */
+    uint64_t *entries;
+    uint64_t mask;
+    uint64_t num_entries;
+} reel_id_shard;
+
+struct _reel_ids {
+    reel_id_shard shards[REEL_ID_MANY + 1][REEL_ID_NUM_SHARDS];
+    uint64_t counter;
+    const void *owner;
+};
+
+static reel_ids *reel_ids_new(reel_arena *arena, const void *owner)
+{
+    uint32_t i, j;
+    reel_ids *ids;
+
+    if (!(ids = reel_arena_calloc(arena, sizeof(reel_ids))))
+        return NULL;
+    for (i = 0; i <= REEL_ID_MANY; i++)
+        for (j = 0; j < REEL_ID_NUM_SHARDS; j++)
+            pthread_mutex_init(&ids->shards[i][j].lock, NULL);
+    ids->owner = owner;
+    return ids;
+}
+
+/* the struct itself is allocated from the arena of the owner */
+static void reel_ids_free(reel_ids *ids)
+{
+    uint32_t i, j;
+    for (i = 0; i <= REEL_ID_MANY; i++)
+        for (j = 0; j < REEL_ID_NUM_SHARDS; j++){
+            pthread_mutex_destroy(&ids->shards[i][j].lock);
+            free(ids->shards[i][j].entries);
+        }
+}
+
+static inline uint64_t reel_id_hash(const uint64_t *key, uint32_t width)
+{
+    uint64_t h = 0;
+    uint32_t i;
+    for (i = 0; i < width; i++){
+        h = (h ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static inline uint64_t *reel_id_probe(uint64_t *entries,
+                                      uint64_t mask,
+                                      uint32_t width,
+                                      const uint64_t *key,
+                                      uint64_t hash)
+{
+    uint64_t i = hash & mask;
+    while (1){
+        uint64_t *e = &entries[i * (width + 1)];
+        if (!e[width] || !memcmp(e, key, width * sizeof(uint64_t)))
+            return e;
+        i = (i + 1) & mask;
+    }
+}
+
+static int reel_id_grow(reel_id_shard *shard, uint32_t width)
+{
+    uint64_t i, size = shard->entries ? shard->mask + 1: 0;
+    uint64_t new_size = size ? size * 2: REEL_ID_MIN_SHARD_SIZE;
+    uint64_t *entries;
+
+    if (!(entries = calloc(new_size, (width + 1) * sizeof(uint64_t))))
+        return -1;
+    for (i = 0; i < size; i++){
+        const uint64_t *e = &shard->entries[i * (width + 1)];
+        if (e[width])
+            memcpy(reel_id_probe(entries,
+                                 new_size - 1,
+                                 width,
+                                 e,
+                                 reel_id_hash(e, width)),
+                   e,
+                   (width + 1) * sizeof(uint64_t));
+    }
+    free(shard->entries);
+    shard->entries = entries;
+    shard->mask = new_size - 1;
+    return 0;
+}
+
+/*
+Set dst to the id of key. Return 1 if the id is new, 0 if it existed
+and -1 if out of memory.
+*/
+static inline int reel_id_get(reel_ids *ids,
+                              reel_id_class cls,
+                              const uint64_t *key,
+                              uint64_t *dst)
+{
+    const uint32_t width = reel_id_widths[cls];
+    uint64_t hash = reel_id_hash(key, width);
+    reel_id_shard *shard = &ids->shards[cls][hash >> (64 - REEL_ID_SHARD_BITS)];
+    uint64_t *e;
+    int ret = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->num_entries + 1) * 2 > (shard->entries ? shard->mask + 1: 0) &&
+        reel_id_grow(shard, width)){
+        ret = -1;
+        goto out;
+    }
+    e = reel_id_probe(shard->entries, shard->mask, width, key, hash);
+    if (!e[width]){
+        memcpy(e, key, width * sizeof(uint64_t));
+        e[width] = __sync_add_and_fetch(&ids->counter, 1);
+        ++shard->num_entries;
+        ret = 1;
+    }
+    *dst = e[width];
+out:
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+/* call fn for all tuples and their ids until fn returns non-zero */
+static int reel_ids_iter(reel_ids *ids, reel_identity_fn fn, void *state)
+{
+    uint64_t k;
+    uint32_t i, j;
+    int ret;
+
+    for (i = 0; i <= REEL_ID_MANY; i++){
+        const uint32_t width = reel_id_widths[i];
+        for (j = 0; j < REEL_ID_NUM_SHARDS; j++){
+            reel_id_shard *shard = &ids->shards[i][j];
+            pthread_mutex_lock(&shard->lock);
+            for (k = 0; shard->entries && k <= shard->mask; k++){
+                const uint64_t *e = &shard->entries[k * (width + 1)];
+                if (!e[width])
+                    continue;
+                if ((ret = fn(e,
+                              i == REEL_ID_MANY ? e[MAX_ID_ITEMS]: width,
+                              e[width],
+                              state))){
+                    pthread_mutex_unlock(&shard->lock);
+                    return ret;
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    return 0;
+}
@@ -6,10 +6,11 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <traildb.h>
 
-#define CSV_BUFFER_SIZE 100000
+#define CSV_BUFFER_SIZE 65536
 #define MAX_NON_INDEX_SIZE 1000
 
 static reel_parse_error reel_parse_uint(uint64_t *dst, const char *src)
@@ -66,29 +67,72 @@ static Pvoid_t create_index(const tdb *db, tdb_field field)
     return index;
 }
 
-static reel_parse_error reel_parse_uinttable(const tdb *db,
+/*
+Lexicon indices are built once per field and shared by all tables of
+the field. They are freed with the context.
+*/
+static Pvoid_t reel_lexicon_index(reel_ctx *ctx, tdb_field field)
+{
+    if (!ctx->lexicons &&
+        !(ctx->lexicons = calloc(tdb_num_fields(ctx->db), sizeof(void*))))
+        return NULL;
+    if (!ctx->lexicons[field])
+        ctx->lexicons[field] = create_index(ctx->db, field);
+    return ctx->lexicons[field];
+}
+
+/* parse the digits of a value, preceded by spaces, up to end */
+static inline int reel_parse_digits(uint64_t *dst,
+                                    const char *src,
+                                    const char *end)
+{
+    uint64_t val = 0;
+
+    while (src < end && *src == ' ')
+        ++src;
+    if (src == end)
+        return -1;
+    for (; src < end; src++){
+        uint64_t digit = (uint64_t)(*src - '0');
+        if (digit > 9 || val > (UINT64_MAX - digit) / 10)
+            return -1;
+        val = val * 10 + digit;
+    }
+    *dst = val;
+    return 0;
+}
+
+/*
+Parse lines of "value number\n" from src without copying it, so src may
+be a mapped file that doesn't end with a zero.
+*/
+static reel_parse_error reel_parse_uinttable(reel_ctx *ctx,
                                              reel_var *var,
-                                             const char *src)
+                                             const char *src,
+                                             uint64_t size)
 {
     tdb_item item;
     reel_parse_error err = 0;
-    uint64_t len, size = strlen(src);
+    uint64_t len, uint;
     const char *end = src + size;
-    uint64_t *table = (uint64_t*)var->value;
-    char *val;
+    const tdb *db = ctx->db;
+    reel_table *table = (reel_table*)var->value;
+    const char *val, *eol;
 
     Pvoid_t index = NULL;
-    Word_t tmp;
 
     if (!var->table_field)
         return REEL_PARSE_EMPTY_TABLE;
 
-    if (size > MAX_NON_INDEX_SIZE)
-        index = create_index(db, var->table_field);
+    if (size > MAX_NON_INDEX_SIZE &&
+        !(index = reel_lexicon_index(ctx, var->table_field)))
+        return REEL_PARSE_OUT_OF_MEMORY;
 
     while (src < end){
 
-        if (!(val = strchr(src, ' ')))
+        if (!(val = memchr(src, ' ', end - src)))
+            return REEL_PARSE_INVALID_VALUE;
+        if (!(eol = memchr(val, '\n', end - val)))
             return REEL_PARSE_INVALID_VALUE;
 
         len = val - src;
@@ -103,90 +147,170 @@ static reel_parse_error reel_parse_uinttable(const tdb *db,
         }else
             item = tdb_get_item(db, var->table_field, src, len);
         if (item){
-            char *p;
-            uint64_t uint = strtoull(val, &p, 10);
-            if (*p != '\n')
+            if (reel_parse_digits(&uint, val, eol))
                 return REEL_PARSE_INVALID_VALUE;
-            table[tdb_item_val(item)] = uint;
-            src = p + 1;
-        }else{
-            if (!(src = strchr(val, '\n')))
-                return REEL_PARSE_INVALID_VALUE;
-            ++src;
+            if (reel_table_store(table, tdb_item_val(item), uint))
+                return REEL_PARSE_OUT_OF_MEMORY;
+        }else
             err = REEL_PARSE_SOME_VALUES_UNKNOWN;
-        }
+        src = eol + 1;
     }
-    JHSFA(tmp, index);
     return err;
 }
 
-static reel_parse_error reel_parse_var(reel_ctx *ctx,
-                                       const char *var_name,
-                                       const char *value)
+static reel_var *reel_find_var(reel_ctx *ctx, const char *var_name)
 {
-    reel_var *var = NULL;
-    reel_parse_error ret;
     uint64_t i;
-
     for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++)
-        if (!strcmp(ctx->vars[i].name, var_name)){
-            var = &ctx->vars[i];
-            break;
-        }
-    if (!var)
+        if (!strcmp(ctx->vars[i].name, var_name))
+            return &ctx->vars[i];
+    return NULL;
+}
+
+/* parse a value of len bytes, which doesn't need to end with a zero */
+static reel_parse_error reel_parse_var_len(reel_ctx *ctx,
+                                           const char *var_name,
+                                           const char *value,
+                                           uint64_t len)
+{
+    reel_var *var;
+    reel_parse_error ret = 0;
+    char *str = NULL;
+
+    if (!(var = reel_find_var(ctx, var_name)))
         return REEL_PARSE_UNKNOWN_VARIABLE;
+    if (var->type == REEL_UINTTABLE)
+        return reel_parse_uinttable(ctx, var, value, len);
+
+    /* scalar values are short, they are parsed from a copy */
+    if (!(str = malloc(len + 1)))
+        return REEL_PARSE_OUT_OF_MEMORY;
+    memcpy(str, value, len);
+    str[len] = 0;
+
     switch (var->type) {
         case REEL_UINT:
-            if ((ret = reel_parse_uint(&var->value, value)))
-                return ret;
+            ret = reel_parse_uint(&var->value, str);
             break;
         case REEL_ITEM:
-            if ((ret = reel_parse_item(ctx->db, &var->value, value)))
-                return ret;
+            ret = reel_parse_item(ctx->db, &var->value, str);
             break;
         case REEL_UINTTABLE:
-            if ((ret = reel_parse_uinttable(ctx->db, var, value)))
-                return ret;
+            break;
+        case REEL_HLL:
+        case REEL_BITMAP:
+        case REEL_QUANTILES:
+        case REEL_FUNNEL:
+            ret = REEL_PARSE_INVALID_VALUE;
             break;
     }
-    return 0;
+    free(str);
+    return ret;
 }
 
-static char *reel_str_append(char *buf,
-                             uint64_t *offset,
-                             uint64_t *size,
-                             const char *fmt,
-                             ...)
+static reel_parse_error reel_parse_var(reel_ctx *ctx,
+                                       const char *var_name,
+                                       const char *value)
 {
-    int len;
-    va_list ap;
+    return reel_parse_var_len(ctx, var_name, value, strlen(value));
+}
 
-    while (1){
-        va_start(ap, fmt);
-        len = vsnprintf(&buf[*offset], *size - *offset, fmt, ap);
-        va_end(ap);
+/*
+Hash of the name and the values of a field, in the order of the
+lexicon, so that a binary table is only used with the lexicon that it
+was written for.
+*/
+static uint64_t reel_hash_value(uint64_t h, const char *val, uint64_t len)
+{
+    uint64_t i;
 
-        if (len < *size - *offset){
-            *offset += len;
-            return buf;
-        }else{
-            char *p;
-            *size *= 2;
-            if ((p = realloc(buf, *size)))
-                buf = p;
-            else{
-                free(buf);
-                return NULL;
-            }
-        }
+    /* FNV-1a over the length and the bytes of the value */
+    for (i = 0; i < sizeof(uint64_t); i++)
+        h = (h ^ ((len >> (i * 8)) & 0xff)) * 0x100000001B3ULL;
+    for (i = 0; i < len; i++)
+        h = (h ^ (uint8_t)val[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+static uint64_t reel_lexicon_fingerprint(const tdb *db, tdb_field field)
+{
+    const char *name = tdb_get_field_name(db, field);
+    uint64_t i, len, h = 0xCBF29CE484222325ULL;
+    uint64_t size = tdb_lexicon_size(db, field);
+
+    h = reel_hash_value(h, name, strlen(name));
+    for (i = 0; i < size; i++){
+        const char *val = tdb_get_value(db, field, i, &len);
+        h = reel_hash_value(h, val, len);
     }
+    return h;
 }
 
-static void reel_merge_vars(reel_ctx *dst, const reel_ctx *src, reel_merge_mode mode)
+/*
+Binary tables, see REEL_TABLE_MAGIC, are used in place: their pages
+point to data, which must stay mapped as long as the context and its
+clones exist. The pages are not owned by the table, so they are copied
+before they are written to.
+*/
+static reel_parse_error reel_map_table(reel_ctx *ctx,
+                                       const char *var_name,
+                                       const void *data,
+                                       uint64_t size)
 {
-    uint64_t i, j;
-    uint64_t *dst_table;
-    const uint64_t *src_table;
+    const uint64_t *head = (const uint64_t*)data;
+    const uint8_t *widths = (const uint8_t*)&head[4];
+    const char *page;
+    const char *end = (const char*)data + size;
+    reel_table *table;
+    reel_var *var;
+    uint64_t i, len, num_pages;
+
+    if (!(var = reel_find_var(ctx, var_name)))
+        return REEL_PARSE_UNKNOWN_VARIABLE;
+    if (var->type != REEL_UINTTABLE)
+        return REEL_PARSE_INVALID_VALUE;
+    if (!var->table_field)
+        return REEL_PARSE_EMPTY_TABLE;
+    table = (reel_table*)var->value;
+
+    if (size < 4 * sizeof(uint64_t) ||
+        memcmp(data, REEL_TABLE_MAGIC, sizeof(uint64_t)))
+        return REEL_PARSE_INVALID_VALUE;
+    num_pages = head[3];
+    if (head[1] != tdb_lexicon_size(ctx->db, var->table_field) ||
+        num_pages > table->num_pages ||
+        head[2] != reel_lexicon_fingerprint(ctx->db, var->table_field))
+        return REEL_PARSE_TABLE_MISMATCH;
+
+    page = (const char*)&head[4] + ((num_pages + 7) & ~7ULL);
+    if (page > end)
+        return REEL_PARSE_INVALID_VALUE;
+    for (i = 0, len = 0; i < num_pages; i++){
+        if (widths[i] == REEL_TABLE_ZERO_PAGE)
+            continue;
+        if (widths[i] > REEL_WIDTH_64)
+            return REEL_PARSE_INVALID_VALUE;
+        len += REEL_TABLE_PAGE_SIZE << widths[i];
+    }
+    if ((uint64_t)(end - page) < len)
+        return REEL_PARSE_INVALID_VALUE;
+
+    for (i = 0; i < num_pages; i++){
+        reel_table_release(table, i);
+        if (widths[i] == REEL_TABLE_ZERO_PAGE)
+            continue;
+        table->pages[i] = (void*)page;
+        table->page_flags[i] = widths[i] << REEL_PAGE_WIDTH_SHIFT;
+        page += REEL_TABLE_PAGE_SIZE << widths[i];
+    }
+    return 0;
+}
+
+static reel_error reel_merge_vars(reel_ctx *dst, const reel_ctx *src, reel_merge_mode mode)
+{
+    uint64_t i;
+    reel_table *dst_table;
+    const reel_table *src_table;
 
     if (mode == REEL_MERGE_ADD){
         for (i = 0; i < sizeof(src->vars) / sizeof(reel_var); i++){
@@ -198,13 +322,38 @@ static void reel_merge_vars(reel_ctx *dst, const reel_ctx *src, reel_merge_mode
                     dst->vars[i].value = src->vars[i].value;
                     break;
                 case REEL_UINTTABLE:
-                    if (!(src->vars[i].flags & REEL_FLAG_IS_CONST)){
-                        src_table = (const uint64_t*)src->vars[i].value;
-                        dst_table = (uint64_t*)dst->vars[i].value;
-                        for (j = 0; j < src->vars[i].table_length; j++)
-                            dst_table[j] += src_table[j];
+                    if (src->vars[i].table_field &&
+                        !(src->vars[i].flags & REEL_FLAG_IS_CONST)){
+                        src_table = (const reel_table*)src->vars[i].value;
+                        dst_table = (reel_table*)dst->vars[i].value;
+                        if (reel_table_combine(dst_table, src_table, 0))
+                            return REEL_OUT_OF_MEMORY;
                     }
                     break;
+                case REEL_HLL:
+                    if (reel_hll_merge_var(dst->arena,
+                                           &dst->vars[i],
+                                           (const reel_hll*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
+                case REEL_BITMAP:
+                    if (reel_bitmap_merge_var(dst->arena,
+                                              &dst->vars[i],
+                                              (const reel_bitmap*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
+                case REEL_QUANTILES:
+                    if (reel_quantiles_merge_var(dst->arena,
+                                                 &dst->vars[i],
+                                                 (const reel_quantiles*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
+                case REEL_FUNNEL:
+                    if (reel_funnel_merge_var(dst->arena,
+                                              &dst->vars[i],
+                                              (const uint64_t*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
             }
         }
     }else if (mode == REEL_MERGE_OVERWRITE){
@@ -215,155 +364,1181 @@ static void reel_merge_vars(reel_ctx *dst, const reel_ctx *src, reel_merge_mode
                     dst->vars[i].value = src->vars[i].value;
                     break;
                 case REEL_UINTTABLE:
-                    if (!(src->vars[i].flags & REEL_FLAG_IS_CONST)){
-                        src_table = (const uint64_t*)src->vars[i].value;
-                        dst_table = (uint64_t*)dst->vars[i].value;
-                        memcpy(dst_table,
-                               src_table,
-                               src->vars[i].table_length * sizeof(uintptr_t));
+                    if (src->vars[i].table_field &&
+                        !(src->vars[i].flags & REEL_FLAG_IS_CONST)){
+                        src_table = (const reel_table*)src->vars[i].value;
+                        dst_table = (reel_table*)dst->vars[i].value;
+                        if (reel_table_copy(dst_table, src_table))
+                            return REEL_OUT_OF_MEMORY;
                     }
                     break;
+                case REEL_HLL:
+                    if (dst->vars[i].value)
+                        memset((void*)dst->vars[i].value, 0, sizeof(reel_hll));
+                    if (reel_hll_merge_var(dst->arena,
+                                           &dst->vars[i],
+                                           (const reel_hll*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
+                case REEL_BITMAP:
+                    if (dst->vars[i].value)
+                        reel_bitmap_reset((reel_bitmap*)dst->vars[i].value);
+                    if (reel_bitmap_merge_var(dst->arena,
+                                              &dst->vars[i],
+                                              (const reel_bitmap*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
+                case REEL_QUANTILES:
+                    if (dst->vars[i].value)
+                        reel_quantiles_reset((reel_quantiles*)dst->vars[i].value);
+                    if (reel_quantiles_merge_var(dst->arena,
+                                                 &dst->vars[i],
+                                                 (const reel_quantiles*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
+                case REEL_FUNNEL:
+                    if (dst->vars[i].value)
+                        memset((void*)dst->vars[i].value,
+                               0,
+                               dst->vars[i].funnel->num_steps * sizeof(uint64_t));
+                    if (reel_funnel_merge_var(dst->arena,
+                                              &dst->vars[i],
+                                              (const uint64_t*)src->vars[i].value))
+                        return REEL_OUT_OF_MEMORY;
+                    break;
             }
         }
     }
+    return 0;
+}
+
+/* heap of streams ordered by their next key and the stream index */
+static inline int reel_stream_less(const uint64_t *keys, uint64_t a, uint64_t b)
+{
+    return keys[a] < keys[b] || (keys[a] == keys[b] && a < b);
+}
+
+static void reel_stream_sift(uint64_t *heap,
+                             uint64_t num,
+                             const uint64_t *keys,
+                             uint64_t i)
+{
+    while (1){
+        uint64_t min = i, l = 2 * i + 1, r = 2 * i + 2, tmp;
+        if (l < num && reel_stream_less(keys, heap[l], heap[min]))
+            min = l;
+        if (r < num && reel_stream_less(keys, heap[r], heap[min]))
+            min = r;
+        if (min == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/*
+A k-way merge of the spill runs of a root context and, optionally, its
+children in memory sorted by key, which form the last stream. Children
+with the same key are added up in acc, in the order of the streams.
+*/
+typedef struct {
+    const reel_ctx *ctx;
+    const reel_fork_entry *children;
+    uint64_t num_children;
+    uint64_t next;
+    uint64_t *keys;
+    uint64_t *heap;
+    uint64_t num;
+    reel_ctx *acc;
+    reel_ctx *tmp;
+} reel_spill_merge;
+
+static void reel_spill_merge_free(reel_spill_merge *m)
+{
+    reel_free(m->acc);
+    reel_free(m->tmp);
+    free(m->keys);
+    free(m->heap);
+}
+
+static int reel_spill_merge_init(reel_spill_merge *m,
+                                 const reel_ctx *ctx,
+                                 const reel_fork_entry *children,
+                                 uint64_t num_children)
+{
+    const uint64_t mem = ctx->spill.num_runs;
+    uint64_t i;
+    int ret;
+
+    memset(m, 0, sizeof(reel_spill_merge));
+    m->ctx = ctx;
+    m->children = children;
+    m->num_children = num_children;
+
+    if (!(m->keys = malloc((mem + 1) * sizeof(uint64_t))) ||
+        !(m->heap = malloc((mem + 1) * sizeof(uint64_t))) ||
+        !(m->acc = reel_clone_empty(ctx, NULL)) ||
+        !(m->tmp = reel_clone_empty(ctx, NULL)))
+        goto error;
+
+    for (i = 0; i < mem; i++){
+        if (fseek(ctx->spill.runs[i], 0, SEEK_SET))
+            goto error;
+        if ((ret = reel_spill_read_key(ctx->spill.runs[i], &m->keys[i])) < 0)
+            goto error;
+        if (ret)
+            m->heap[m->num++] = i;
+    }
+    if (num_children){
+        m->keys[mem] = children[0].key;
+        m->heap[m->num++] = mem;
+    }
+    for (i = m->num; i > 0; i--)
+        reel_stream_sift(m->heap, m->num, m->keys, i - 1);
+    return 0;
+error:
+    reel_spill_merge_free(m);
+    return -1;
+}
+
+/* return 1 if the next key was merged to acc, 0 at the end, -1 on error */
+static int reel_spill_merge_next(reel_spill_merge *m, uint64_t *key)
+{
+    const uint64_t mem = m->ctx->spill.num_runs;
+    int ret;
+
+    if (!m->num)
+        return 0;
+
+    *key = m->keys[m->heap[0]];
+    reel_reset_vars(m->acc);
+    while (m->num && m->keys[m->heap[0]] == *key){
+        uint64_t s = m->heap[0];
+        if (s == mem){
+            if (reel_merge_vars(m->acc, m->children[m->next].child, REEL_MERGE_ADD))
+                return -1;
+            if (++m->next < m->num_children)
+                m->keys[mem] = m->children[m->next].key;
+            else
+                m->heap[0] = m->heap[--m->num];
+        }else{
+            FILE *run = m->ctx->spill.runs[s];
+            reel_reset_vars(m->tmp);
+            if (reel_spill_read_vars(run, m->tmp) ||
+                reel_merge_vars(m->acc, m->tmp, REEL_MERGE_ADD))
+                return -1;
+            if ((ret = reel_spill_read_key(run, &m->keys[s])) < 0)
+                return -1;
+            if (!ret)
+                m->heap[0] = m->heap[--m->num];
+        }
+        reel_stream_sift(m->heap, m->num, m->keys, 0);
+    }
+    return 1;
+}
+
+/* merge all runs of a root context to one run in the spill directory */
+static reel_error reel_spill_compact(reel_ctx *ctx)
+{
+    const char *dir = ctx->spill.dir;
+    reel_spill_merge merge;
+    reel_spill runs;
+    uint64_t key;
+    FILE *run;
+    int ret;
+
+    if (!dir || !(run = reel_spill_open(dir)))
+        return REEL_SPILL_FAILED;
+    if (reel_spill_merge_init(&merge, ctx, NULL, 0)){
+        fclose(run);
+        return REEL_OUT_OF_MEMORY;
+    }
+    while ((ret = reel_spill_merge_next(&merge, &key)) > 0)
+        if (reel_spill_write_ctx(run, key, merge.acc)){
+            ret = -1;
+            break;
+        }
+    reel_spill_merge_free(&merge);
+    if (ret < 0 || fflush(run)){
+        fclose(run);
+        return REEL_SPILL_FAILED;
+    }
+
+    runs = ctx->spill;
+    memset(&ctx->spill, 0, sizeof(reel_spill));
+    if (reel_spill_add_run(&ctx->spill, run)){
+        ctx->spill = runs;
+        fclose(run);
+        return REEL_OUT_OF_MEMORY;
+    }
+    ctx->spill.dir = dir;
+    reel_spill_free(&runs);
+    return 0;
+}
+
+/*
+Spill children and, once there are REEL_SPILL_MAX_RUNS runs, merge all
+runs to one so that the number of open files stays bounded.
+*/
+static reel_error reel_spill_to_disk(reel_ctx *ctx, const char *dir)
+{
+    reel_error err;
+
+    if ((err = reel_spill_children(ctx, dir)))
+        return err;
+    if (ctx->spill.num_runs < REEL_SPILL_MAX_RUNS)
+        return 0;
+    return reel_spill_compact(ctx);
 }
 
 static reel_error reel_merge_ctx(reel_ctx *dst, const reel_ctx *src, reel_merge_mode mode)
 {
-    Word_t *ptr;
-    Word_t key = 0;
+    uint64_t i;
+    reel_error err;
 
     if (!(dst == dst->root && src == src->root))
         return REEL_MERGE_NOT_PARENT;
 
-    reel_merge_vars(dst, src, mode);
+    if ((err = reel_merge_vars(dst, src, mode)))
+        return err;
 
     /* handle children */
-    JLF(ptr, src->child_contexts, key);
-    while (ptr){
-        const reel_ctx *src_child = (const reel_ctx*)*ptr;
+    for (i = 0; i < src->forks.num_children; i++){
+        const reel_fork_entry *e = &src->forks.children[i];
+        const reel_ctx *src_child = e->child;
         reel_ctx *dst_child;
 
-        JLI(ptr, dst->child_contexts, key);
-        if (*ptr)
-            dst_child = (reel_ctx*)*ptr;
-        else{
-            if (!(dst_child = reel_clone(src_child, NULL, 1, 0)))
+        if (!(dst_child = reel_fork_get(&dst->forks, e->key))){
+            reel_arena *arena = reel_fork_arena(dst);
+            if (!arena ||
+                !(dst_child = reel_clone_empty(src_child, arena)))
                 return REEL_OUT_OF_MEMORY;
             dst_child->root = dst;
             dst_child->db = dst->db;
-            *ptr = (Word_t)dst_child;
+            if (reel_fork_put(&dst->forks, e->key, dst_child))
+                return REEL_OUT_OF_MEMORY;
         }
-        reel_merge_vars(dst_child, src_child, mode);
-
-        JLN(ptr, src->child_contexts, key);
+        if ((err = reel_merge_vars(dst_child, src_child, mode)))
+            return err;
     }
 
+    /*
+    spilled children are merged at output, which can only add them. The
+    runs of all threads are compacted like those of one thread, so that
+    the output doesn't open them all at once.
+    */
+    if (src->spill.num_runs){
+        if (mode != REEL_MERGE_ADD)
+            return REEL_SPILL_FAILED;
+        if ((err = reel_spill_copy_runs(&dst->spill, &src->spill)))
+            return err;
+        if (dst->spill.num_runs >= REEL_SPILL_MAX_RUNS)
+            return reel_spill_compact(dst);
+    }
     return 0;
 }
 
-#define STRADD(...) if (!(buf = reel_str_append(buf, offset, size, __VA_ARGS__))) return NULL;
+/*
+Output is written through a fixed-size buffer that is flushed to a
+file descriptor or, if fd is negative, appended to a string in memory.
+Once an error occurs, the rest of the output is discarded.
+*/
+typedef struct {
+    int fd;
+    char *str;
+    uint64_t str_len;
+    uint64_t str_size;
+    reel_error error;
+    char delimiter;
+    double scale;
+    /* rows to output if ordered by a column, see reel_output_visit */
+    const struct _reel_output_selection *selection;
+    uint64_t limit;
+    /* bytes output so far */
+    uint64_t offset;
+    uint64_t len;
+    char buf[CSV_BUFFER_SIZE];
+} reel_output;
+
+static const char reel_output_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
 
-static char *reel_output_csv_ctx(const reel_ctx *ctx,
-                                 char delimiter,
-                                 char *buf,
-                                 uint64_t *offset,
-                                 uint64_t *size)
+static void reel_output_flush(reel_output *out)
+{
+    uint64_t offset = 0;
+
+    if (out->error)
+        ;
+    else if (out->fd < 0){
+        /* leave room for the terminating zero */
+        if (out->str_len + out->len + 1 > out->str_size){
+            uint64_t size = out->str_size ? out->str_size: CSV_BUFFER_SIZE;
+            char *str;
+            while (out->str_len + out->len + 1 > size)
+                size *= 2;
+            if (!(str = realloc(out->str, size))){
+                out->error = REEL_OUT_OF_MEMORY;
+                out->len = 0;
+                return;
+            }
+            out->str = str;
+            out->str_size = size;
+        }
+        memcpy(&out->str[out->str_len], out->buf, out->len);
+        out->str_len += out->len;
+    }else
+        while (offset < out->len){
+            ssize_t n = write(out->fd, &out->buf[offset], out->len - offset);
+            if (n < 0){
+                if (errno == EINTR)
+                    continue;
+                out->error = REEL_OUTPUT_FAILED;
+                break;
+            }
+            offset += n;
+        }
+    out->len = 0;
+}
+
+static void reel_output_str(reel_output *out, const char *str, uint64_t len)
+{
+    out->offset += len;
+    if (len <= CSV_BUFFER_SIZE - out->len){
+        memcpy(&out->buf[out->len], str, len);
+        out->len += len;
+        return;
+    }
+    while (len){
+        uint64_t n = CSV_BUFFER_SIZE - out->len;
+        if (!n){
+            reel_output_flush(out);
+            n = CSV_BUFFER_SIZE;
+        }
+        if (n > len)
+            n = len;
+        memcpy(&out->buf[out->len], str, n);
+        out->len += n;
+        str += n;
+        len -= n;
+    }
+}
+
+static inline void reel_output_char(reel_output *out, char c)
+{
+    if (out->len == CSV_BUFFER_SIZE)
+        reel_output_flush(out);
+    out->buf[out->len++] = c;
+    ++out->offset;
+}
+
+/* format two digits at a time, from the end */
+static inline void reel_output_uint(reel_output *out, uint64_t val)
+{
+    char tmp[20];
+    char *p = &tmp[20];
+
+    while (val >= 100){
+        const char *d = &reel_output_digits[(val % 100) * 2];
+        val /= 100;
+        *--p = d[1];
+        *--p = d[0];
+    }
+    if (val >= 10){
+        *--p = reel_output_digits[val * 2 + 1];
+        *--p = reel_output_digits[val * 2];
+    }else
+        *--p = '0' + val;
+    reel_output_str(out, p, &tmp[20] - p);
+}
+
+/*
+A variable is output as one or more columns: quantiles have a column
+for each percentile, funnels for each step and tables for each value of
+their field. Variables that don't start with an uppercase letter have
+no columns.
+*/
+static uint64_t reel_output_num_columns(const reel_var *v)
+{
+    if (v->name[0] == '_' || !isupper(v->name[0]))
+        return 0;
+    switch (v->type){
+        case REEL_QUANTILES:
+            return v->num_percentiles;
+        case REEL_FUNNEL:
+            return v->funnel->num_steps;
+        case REEL_UINTTABLE:
+            return v->table_length;
+        default:
+            return 1;
+    }
+}
+
+/* the value of column k of a variable that is not an item */
+static uint64_t reel_output_value(const reel_ctx *ctx,
+                                  const reel_var *v,
+                                  uint64_t k)
+{
+    switch (v->type){
+        case REEL_HLL:
+            return reel_hll_estimate((const reel_hll*)v->value);
+        case REEL_BITMAP:
+            if (v->flags & REEL_FLAG_IS_DERIVED)
+                return reel_bitmap_intersection_cardinality(
+                    (const reel_bitmap*)ctx->vars[v->operands[0]].value,
+                    (const reel_bitmap*)ctx->vars[v->operands[1]].value);
+            return reel_bitmap_cardinality((const reel_bitmap*)v->value);
+        case REEL_QUANTILES:
+            return reel_quantiles_value((const reel_quantiles*)v->value,
+                                        v->percentiles[k]);
+        case REEL_FUNNEL:
+            return v->value ? ((const uint64_t*)v->value)[k]: 0;
+        case REEL_UINTTABLE:
+            return reel_table_get((const reel_table*)v->value, k);
+        default:
+            return v->value;
+    }
+}
+
+/* scale the value of a column as given by reel_output_options */
+static inline uint64_t reel_output_scaled(const reel_output *out,
+                                          const reel_var *v,
+                                          uint64_t val)
+{
+    if (!out->scale ||
+        !(v->type == REEL_UINT ||
+          v->type == REEL_UINTTABLE ||
+          v->type == REEL_FUNNEL) ||
+        (v->flags & REEL_FLAG_IS_CONST))
+        return val;
+    return (uint64_t)(val * out->scale + 0.5);
+}
+
+static const char *reel_output_item(const reel_ctx *ctx,
+                                    const reel_var *v,
+                                    uint64_t *len)
 {
-    uint64_t len, m, k, i, j;
     const char *val;
-    const uint64_t *uinttable;
+    if (v->value && (val = tdb_get_item_value(ctx->db, v->value, len)))
+        return val;
+    *len = 0;
+    return "";
+}
 
-    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++)
-        if (!strcmp(ctx->vars[i].name, "_HIDE") && ctx->vars[i].value)
+#define REEL_OUTPUT_LABEL_SIZE 32
+
+/*
+Return the label of column k of a variable, which follows the name of
+the variable and a colon in the column name, or NULL if the column is
+named by the variable only.
+*/
+static const char *reel_output_label(const reel_ctx *ctx,
+                                     const reel_var *v,
+                                     uint64_t k,
+                                     char buf[REEL_OUTPUT_LABEL_SIZE],
+                                     uint64_t *len)
+{
+    const char *label;
+    switch (v->type){
+        case REEL_QUANTILES:
+            *len = snprintf(buf, REEL_OUTPUT_LABEL_SIZE, "p%g", v->percentiles[k]);
             return buf;
+        case REEL_FUNNEL:
+            label = v->funnel->labels[k];
+            *len = strlen(label);
+            return label;
+        case REEL_UINTTABLE:
+            if ((label = tdb_get_value(ctx->db, v->table_field, k, len)))
+                return label;
+            *len = 0;
+            return "";
+        default:
+            return NULL;
+    }
+}
 
-    for (i = 0, j = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
-        const reel_var *v = &ctx->vars[i];
-        if (v->name[0] == '_' || !isupper(v->name[0]))
-            continue;
-        if (j++){
-            STRADD("%c", delimiter)
+/* return the length of the name */
+static uint64_t reel_output_column_name(const reel_ctx *ctx,
+                                        const reel_var *v,
+                                        uint64_t k,
+                                        reel_output *out)
+{
+    char buf[REEL_OUTPUT_LABEL_SIZE];
+    uint64_t len, name_len = strlen(v->name);
+    const char *label = reel_output_label(ctx, v, k, buf, &len);
+
+    if (out){
+        reel_output_str(out, v->name, name_len);
+        if (label){
+            reel_output_char(out, ':');
+            reel_output_str(out, label, len);
         }
-        switch (ctx->vars[i].type) {
-            case REEL_UINT:
-                STRADD("%"PRIu64, v->value)
-                break;
-            case REEL_ITEM:
-                if (v->value){
-                    val = tdb_get_item_value(ctx->db, v->value, &len);
-                    STRADD("%.*s", len, val)
-                }
+    }
+    return label ? name_len + 1 + len: name_len;
+}
+
+static int reel_output_is_hidden(const reel_ctx *ctx)
+{
+    uint64_t i;
+    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++)
+        if (!strcmp(ctx->vars[i].name, "_HIDE") && ctx->vars[i].value)
+            return 1;
+    return 0;
+}
+
+/* called for each row of output, non-zero return stops */
+typedef int (*reel_output_row_fn)(const reel_ctx *row, void *state);
+
+/*
+Call fn for each row of output that isn't hidden: the parent and then
+its children in the order of their keys. Children that are partly
+spilled are added up with their runs. Rows are visited one at a time,
+so the output doesn't have to fit in memory.
+*/
+static reel_error reel_output_rows(const reel_ctx *ctx,
+                                   reel_output_row_fn fn,
+                                   void *state)
+{
+    reel_fork_entry *children;
+    reel_spill_merge merge;
+    reel_error err = 0;
+    uint64_t i, key;
+    int ret = 0;
+
+    if (!reel_output_is_hidden(ctx) && fn(ctx, state))
+        return 0;
+    if (!(children = reel_fork_sorted(&ctx->forks)))
+        return REEL_OUT_OF_MEMORY;
+
+    if (!ctx->spill.num_runs){
+        for (i = 0; i < ctx->forks.num_children; i++)
+            if (!reel_output_is_hidden(children[i].child) &&
+                fn(children[i].child, state))
                 break;
-            case REEL_UINTTABLE:
-                uinttable = (const uint64_t*)v->value;
-                for (m = 0, k = 0; k < v->table_length; k++){
-                    if (m++){
-                        STRADD("%c", delimiter)
-                    }
-                    STRADD("%"PRIu64, uinttable[k])
-                }
+    }else if (reel_spill_merge_init(&merge, ctx, children, ctx->forks.num_children))
+        err = REEL_OUT_OF_MEMORY;
+    else{
+        while ((ret = reel_spill_merge_next(&merge, &key)) > 0)
+            if (!reel_output_is_hidden(merge.acc) && fn(merge.acc, state))
                 break;
+        if (ret < 0)
+            err = REEL_SPILL_FAILED;
+        reel_spill_merge_free(&merge);
+    }
+    free(children);
+    return err;
+}
+
+/*
+Rows ordered by a column are selected with a heap of the rows that
+come first in the order, so that only limit rows are kept and output.
+Rows merged from spilled runs are temporary, so the selected ones are
+copied.
+*/
+typedef struct {
+    const reel_ctx *ctx;
+    uint64_t value;
+    uint64_t seq;
+    int is_copy;
+} reel_output_row;
+
+typedef struct _reel_output_selection {
+    const reel_ctx *root;
+    uint32_t var;
+    uint64_t column;
+    int descending;
+    uint64_t limit;
+    uint64_t seq;
+    reel_output_row *rows;
+    uint64_t num_rows;
+    uint64_t rows_size;
+    reel_error error;
+} reel_output_selection;
+
+/* return 1 if row a is output after row b, ties in the order of keys */
+static inline int reel_output_after(const reel_output_selection *s,
+                                    const reel_output_row *a,
+                                    const reel_output_row *b)
+{
+    if (a->value != b->value)
+        return s->descending ? a->value < b->value: a->value > b->value;
+    return a->seq > b->seq;
+}
+
+/* the heap has the row that is output last at the top */
+static void reel_output_sift(reel_output_selection *s, uint64_t i, uint64_t n)
+{
+    reel_output_row row = s->rows[i];
+    while (1){
+        uint64_t child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n &&
+            reel_output_after(s, &s->rows[child + 1], &s->rows[child]))
+            ++child;
+        if (!reel_output_after(s, &s->rows[child], &row))
+            break;
+        s->rows[i] = s->rows[child];
+        i = child;
+    }
+    s->rows[i] = row;
+}
+
+static int reel_output_select_row(const reel_ctx *ctx, void *state)
+{
+    reel_output_selection *s = (reel_output_selection*)state;
+    int is_full = s->limit && s->num_rows == s->limit;
+    reel_output_row row;
+    uint64_t i;
+
+    row.ctx = ctx;
+    row.value = reel_output_value(ctx, &ctx->vars[s->var], s->column);
+    row.seq = s->seq++;
+    row.is_copy = 0;
+
+    if (is_full && !reel_output_after(s, &s->rows[0], &row))
+        return 0;
+
+    if (!is_full && s->num_rows == s->rows_size){
+        uint64_t size = s->rows_size ? s->rows_size * 2: 64;
+        reel_output_row *rows;
+        if (!(rows = realloc(s->rows, size * sizeof(reel_output_row)))){
+            s->error = REEL_OUT_OF_MEMORY;
+            return 1;
         }
+        s->rows = rows;
+        s->rows_size = size;
     }
-    STRADD("\n");
-    return buf;
+
+    /* a root other than the parent is a merge of spilled children */
+    if (ctx->root == ctx && ctx != s->root){
+        reel_ctx *copy;
+        if (!(copy = reel_clone_empty(ctx, NULL))){
+            s->error = REEL_OUT_OF_MEMORY;
+            return 1;
+        }
+        if ((s->error = reel_merge_vars(copy, ctx, REEL_MERGE_OVERWRITE))){
+            reel_free(copy);
+            return 1;
+        }
+        row.ctx = copy;
+        row.is_copy = 1;
+    }
+
+    if (is_full){
+        if (s->rows[0].is_copy)
+            reel_free((reel_ctx*)s->rows[0].ctx);
+        s->rows[0] = row;
+        reel_output_sift(s, 0, s->num_rows);
+    }else{
+        for (i = s->num_rows++;
+             i && reel_output_after(s, &row, &s->rows[(i - 1) / 2]);
+             i = (i - 1) / 2)
+            s->rows[i] = s->rows[(i - 1) / 2];
+        s->rows[i] = row;
+    }
+    return 0;
 }
 
-static char *reel_output_csv(const reel_ctx *ctx, char delimiter)
+static void reel_output_selection_free(reel_output_selection *s)
 {
-    uint64_t size0 = CSV_BUFFER_SIZE;
-    uint64_t *size = &size0;
-    uint64_t offset0 = 0;
-    uint64_t *offset = &offset0;
-    uint64_t len, i, k, m, j;
-    const char *val;
-    char *buf;
-    Word_t key = 0;
-    Word_t *ptr;
+    uint64_t i;
+    for (i = 0; i < s->num_rows; i++)
+        if (s->rows[i].is_copy)
+            reel_free((reel_ctx*)s->rows[i].ctx);
+    free(s->rows);
+}
 
-    if (!(buf = malloc(*size)))
-        return NULL;
+/* find a column that isn't an item by its name in the header */
+static int reel_output_find_column(const reel_ctx *ctx,
+                                   const char *name,
+                                   uint32_t *var,
+                                   uint64_t *column)
+{
+    char buf[REEL_OUTPUT_LABEL_SIZE];
+    const char *label;
+    uint64_t n, i, k, len, name_len;
 
-    /* output header */
-    for (i = 0, j = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
         const reel_var *v = &ctx->vars[i];
-        if (v->name[0] == '_' || !isupper(v->name[0]))
+        name_len = strlen(v->name);
+        if (v->type == REEL_ITEM || strncmp(name, v->name, name_len))
             continue;
-        if (j++){
-            STRADD("%c", delimiter)
+        n = reel_output_num_columns(v);
+        for (k = 0; k < n; k++){
+            if ((label = reel_output_label(ctx, v, k, buf, &len)) ?
+                    name[name_len] == ':' &&
+                    strlen(&name[name_len + 1]) == len &&
+                    !memcmp(&name[name_len + 1], label, len):
+                    !name[name_len]){
+                *var = i;
+                *column = k;
+                return 0;
+            }
         }
-        switch (ctx->vars[i].type){
-            case REEL_UINT:
-            case REEL_ITEM:
-                STRADD("%s", v->name);
-                break;
-            case REEL_UINTTABLE:
-                for (m = 0, k = 0; k < v->table_length; k++){
-                    if (m++){
-                        STRADD("%c", delimiter)
-                    }
-                    val = tdb_get_value(ctx->db, v->table_field, k, &len);
-                    STRADD("%s:%.*s", v->name, len, val)
-                }
+    }
+    return -1;
+}
+
+/* select the rows to output in the order of a column */
+static reel_error reel_output_select(const reel_ctx *ctx,
+                                     const reel_output_options *options,
+                                     reel_output_selection *s)
+{
+    reel_output_row row;
+    reel_error err;
+    uint64_t n;
+
+    memset(s, 0, sizeof(reel_output_selection));
+    if (reel_output_find_column(ctx, options->order_by, &s->var, &s->column))
+        return REEL_UNKNOWN_COLUMN;
+    s->root = ctx;
+    s->descending = options->descending;
+    s->limit = options->limit;
+
+    if ((err = reel_output_rows(ctx, reel_output_select_row, s)) ||
+        (err = s->error))
+        return err;
+
+    /* sort the heap to the order of output */
+    for (n = s->num_rows; n > 1; n--){
+        row = s->rows[0];
+        s->rows[0] = s->rows[n - 1];
+        s->rows[n - 1] = row;
+        reel_output_sift(s, 0, n - 1);
+    }
+    return 0;
+}
+
+typedef struct {
+    reel_output_row_fn fn;
+    void *state;
+    uint64_t left;
+} reel_output_limited;
+
+static int reel_output_limited_row(const reel_ctx *ctx, void *state)
+{
+    reel_output_limited *l = (reel_output_limited*)state;
+    if (!l->left)
+        return 1;
+    --l->left;
+    return l->fn(ctx, l->state);
+}
+
+/* call fn for each row that is output, selected or up to the limit */
+static reel_error reel_output_visit(const reel_ctx *ctx,
+                                    const reel_output *out,
+                                    reel_output_row_fn fn,
+                                    void *state)
+{
+    uint64_t i;
+
+    if (out->selection){
+        for (i = 0; i < out->selection->num_rows; i++)
+            if (fn(out->selection->rows[i].ctx, state))
                 break;
+        return 0;
+    }else if (out->limit){
+        reel_output_limited l = {fn, state, out->limit};
+        return reel_output_rows(ctx, reel_output_limited_row, &l);
+    }else
+        return reel_output_rows(ctx, fn, state);
+}
+
+static int reel_output_csv_row(const reel_ctx *ctx, void *state)
+{
+    reel_output *out = (reel_output*)state;
+    uint64_t len, n, i, j, k;
+    const char *val;
+
+    for (i = 0, j = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+        const reel_var *v = &ctx->vars[i];
+        n = reel_output_num_columns(v);
+        for (k = 0; k < n; k++){
+            if (j++)
+                reel_output_char(out, out->delimiter);
+            if (v->type == REEL_ITEM){
+                val = reel_output_item(ctx, v, &len);
+                reel_output_str(out, val, len);
+            }else
+                reel_output_uint(out,
+                                 reel_output_scaled(out, v, reel_output_value(ctx, v, k)));
         }
     }
-    STRADD("\n");
+    reel_output_char(out, '\n');
+    return out->error;
+}
 
-    /* output parent */
-    if (!(buf = reel_output_csv_ctx(ctx, delimiter, buf, offset, size)))
-        return NULL;
+static void reel_output_csv_header(const reel_ctx *ctx, reel_output *out)
+{
+    uint64_t n, i, j, k;
 
-    /* output children */
-    JLF(ptr, ctx->child_contexts, key);
-    while (ptr){
-        const reel_ctx *child = (const reel_ctx*)*ptr;
-        if (!(buf = reel_output_csv_ctx(child, delimiter, buf, offset, size)))
-            return NULL;
-        JLN(ptr, ctx->child_contexts, key);
+    for (i = 0, j = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+        const reel_var *v = &ctx->vars[i];
+        n = reel_output_num_columns(v);
+        for (k = 0; k < n; k++){
+            if (j++)
+                reel_output_char(out, out->delimiter);
+            reel_output_column_name(ctx, v, k, out);
+        }
     }
-    return buf;
+    reel_output_char(out, '\n');
 }
 
+static reel_error reel_output_csv_rows(const reel_ctx *ctx, reel_output *out)
+{
+    reel_error err;
 
+    reel_output_csv_header(ctx, out);
+    err = reel_output_visit(ctx, out, reel_output_csv_row, out);
+    reel_output_flush(out);
+    return err ? err: out->error;
+}
+
+/*
+Columnar output, for consumers that map the file instead of parsing
+text. The columns are the same as in CSV. All integers are 64-bit
+little-endian and every section starts at a multiple of 8 bytes:
+
+    "REELCOL1"
+    columns in order:
+        uint columns: a value for each row
+        item columns: num_rows + 1 offsets of the values, relative to
+                      the end of the offsets, followed by the values
+    footer:
+        num_rows
+        num_columns
+        for each column: type (1 uint, 2 item), offset of the column
+                         in the file, length of the name, the name
+    offset of the footer in the file
+    "REELCOL1"
+*/
+#define REEL_COLUMNAR_MAGIC "REELCOL1"
+#define REEL_COLUMN_UINT 1
+#define REEL_COLUMN_ITEM 2
+
+typedef struct {
+    reel_output *out;
+    uint32_t var;
+    uint64_t k;
+    uint64_t num_rows;
+    uint64_t value_offset;
+} reel_output_column;
+
+static inline void reel_output_word(reel_output *out, uint64_t val)
+{
+    reel_output_str(out, (const char*)&val, sizeof(uint64_t));
+}
+
+static void reel_output_align(reel_output *out)
+{
+    static const char zeros[8];
+    reel_output_str(out, zeros, (8 - (out->offset & 7)) & 7);
+}
+
+static int reel_output_column_uint(const reel_ctx *ctx, void *state)
+{
+    reel_output_column *c = (reel_output_column*)state;
+    const reel_var *v = &ctx->vars[c->var];
+    reel_output_word(c->out,
+                     reel_output_scaled(c->out, v, reel_output_value(ctx, v, c->k)));
+    ++c->num_rows;
+    return c->out->error;
+}
+
+static int reel_output_column_offset(const reel_ctx *ctx, void *state)
+{
+    reel_output_column *c = (reel_output_column*)state;
+    uint64_t len;
+    reel_output_item(ctx, &ctx->vars[c->var], &len);
+    reel_output_word(c->out, c->value_offset += len);
+    ++c->num_rows;
+    return c->out->error;
+}
+
+static int reel_output_column_item(const reel_ctx *ctx, void *state)
+{
+    reel_output_column *c = (reel_output_column*)state;
+    uint64_t len;
+    const char *val = reel_output_item(ctx, &ctx->vars[c->var], &len);
+    reel_output_str(c->out, val, len);
+    return c->out->error;
+}
+
+static int reel_output_column_count(const reel_ctx *ctx, void *state)
+{
+    ++((reel_output_column*)state)->num_rows;
+    return 0;
+}
+
+static reel_error reel_output_columnar_rows(const reel_ctx *ctx, reel_output *out)
+{
+    const uint64_t num_vars = sizeof(ctx->vars) / sizeof(reel_var);
+    uint64_t n, i, j, k, footer, num_columns = 0;
+    uint64_t *offsets;
+    reel_output_column c;
+    reel_error err = 0;
+
+    for (i = 0; i < num_vars; i++)
+        num_columns += reel_output_num_columns(&ctx->vars[i]);
+    if (!(offsets = malloc((num_columns + 1) * sizeof(uint64_t))))
+        return REEL_OUT_OF_MEMORY;
+
+    memset(&c, 0, sizeof(reel_output_column));
+    c.out = out;
+    reel_output_str(out, REEL_COLUMNAR_MAGIC, 8);
+
+    /* each column is a pass over the rows */
+    for (i = 0, j = 0; i < num_vars && !err; i++){
+        n = reel_output_num_columns(&ctx->vars[i]);
+        for (k = 0; k < n && !err; k++){
+            c.var = i;
+            c.k = k;
+            c.num_rows = c.value_offset = 0;
+            offsets[j++] = out->offset;
+            if (ctx->vars[i].type == REEL_ITEM){
+                reel_output_word(out, 0);
+                if (!(err = reel_output_visit(ctx, out, reel_output_column_offset, &c)))
+                    err = reel_output_visit(ctx, out, reel_output_column_item, &c);
+                reel_output_align(out);
+            }else
+                err = reel_output_visit(ctx, out, reel_output_column_uint, &c);
+        }
+    }
+    if (!num_columns)
+        err = reel_output_visit(ctx, out, reel_output_column_count, &c);
+
+    if (!err){
+        footer = out->offset;
+        reel_output_word(out, c.num_rows);
+        reel_output_word(out, num_columns);
+        for (i = 0, j = 0; i < num_vars; i++){
+            const reel_var *v = &ctx->vars[i];
+            n = reel_output_num_columns(v);
+            for (k = 0; k < n; k++){
+                reel_output_word(out, v->type == REEL_ITEM ? REEL_COLUMN_ITEM:
+                                                             REEL_COLUMN_UINT);
+                reel_output_word(out, offsets[j++]);
+                reel_output_word(out, reel_output_column_name(ctx, v, k, NULL));
+                reel_output_column_name(ctx, v, k, out);
+                reel_output_align(out);
+            }
+        }
+        reel_output_word(out, footer);
+        reel_output_str(out, REEL_COLUMNAR_MAGIC, 8);
+    }
+    free(offsets);
+    reel_output_flush(out);
+    return err ? err: out->error;
+}
+
+/* output to out as given by options */
+static reel_error reel_output_with_options(const reel_ctx *ctx,
+                                           reel_output *out,
+                                           const reel_output_options *options)
+{
+    reel_output_selection selection;
+    reel_error err = 0;
+
+    out->delimiter = options->delimiter ? options->delimiter: ',';
+    out->limit = options->limit;
+    out->scale = options->scale;
+
+    if (options->order_by){
+        if (!(err = reel_output_select(ctx, options, &selection)))
+            out->selection = &selection;
+    }
+    if (!err){
+        if (options->format == REEL_FORMAT_COLUMNAR)
+            err = reel_output_columnar_rows(ctx, out);
+        else
+            err = reel_output_csv_rows(ctx, out);
+    }
+    if (options->order_by)
+        reel_output_selection_free(&selection);
+    out->selection = NULL;
+    return err;
+}
+
+static reel_error reel_output_fd(const reel_ctx *ctx,
+                                int fd,
+                                const reel_output_options *options)
+{
+    reel_output *out;
+    reel_error err;
+
+    if (!(out = calloc(1, sizeof(reel_output))))
+        return REEL_OUT_OF_MEMORY;
+    out->fd = fd;
+    err = reel_output_with_options(ctx, out, options);
+    free(out);
+    return err;
+}
+
+static reel_error reel_output_csv_fd(const reel_ctx *ctx, int fd, char delimiter)
+{
+    reel_output_options options = {.format = REEL_FORMAT_CSV,
+                                   .delimiter = delimiter};
+    return reel_output_fd(ctx, fd, &options);
+}
+
+static reel_error reel_output_columnar_fd(const reel_ctx *ctx, int fd)
+{
+    reel_output_options options = {.format = REEL_FORMAT_COLUMNAR};
+    return reel_output_fd(ctx, fd, &options);
+}
+
+/*
+CSV output of many children can be split in parts of consecutive
+children in the order of keys, which are formatted to separate strings,
+for instance by different threads, and output in order. The first part
+has the header and the parent. Merging spilled runs, ordering by a
+column and limits are sequential, so their output is a single part.
+*/
+#define REEL_OUTPUT_MIN_PART_ROWS 4096
+
+static reel_error reel_output_split_init(reel_output_split *split,
+                                         const reel_ctx *ctx,
+                                         const reel_output_options *options,
+                                         uint32_t num_parts)
+{
+    memset(split, 0, sizeof(reel_output_split));
+    split->ctx = ctx;
+    split->options = *options;
+    split->num_parts = 1;
+
+    if (options->format != REEL_FORMAT_CSV ||
+        options->order_by ||
+        options->limit ||
+        ctx->spill.num_runs)
+        return 0;
+
+    if (num_parts > ctx->forks.num_children / REEL_OUTPUT_MIN_PART_ROWS)
+        num_parts = ctx->forks.num_children / REEL_OUTPUT_MIN_PART_ROWS;
+    if (num_parts < 2)
+        return 0;
+
+    if (!(split->children = reel_fork_sorted(&ctx->forks)))
+        return REEL_OUT_OF_MEMORY;
+    split->num_children = ctx->forks.num_children;
+    split->num_parts = num_parts;
+    return 0;
+}
+
+/*
+Format a part to a string, the caller must free it. Parts may be
+formatted concurrently.
+*/
+static reel_error reel_output_part(const reel_output_split *split,
+                                   uint32_t part,
+                                   char **str,
+                                   uint64_t *len)
+{
+    const reel_ctx *ctx = (const reel_ctx*)split->ctx;
+    reel_output *out;
+    reel_error err = 0;
+    uint64_t i, end;
+
+    *str = NULL;
+    *len = 0;
+    if (part >= split->num_parts)
+        return 0;
+    if (!(out = calloc(1, sizeof(reel_output))))
+        return REEL_OUT_OF_MEMORY;
+    out->fd = -1;
+
+    if (!split->children)
+        err = reel_output_with_options(ctx, out, &split->options);
+    else{
+        out->delimiter = split->options.delimiter ? split->options.delimiter: ',';
+        out->scale = split->options.scale;
+        if (!part){
+            reel_output_csv_header(ctx, out);
+            if (!reel_output_is_hidden(ctx))
+                reel_output_csv_row(ctx, out);
+        }
+        i = part * split->num_children / split->num_parts;
+        end = (part + 1) * split->num_children / split->num_parts;
+        for (; i < end && !out->error; i++)
+            if (!reel_output_is_hidden(split->children[i].child))
+                reel_output_csv_row(split->children[i].child, out);
+        reel_output_flush(out);
+        err = out->error;
+    }
+    if (err)
+        free(out->str);
+    else{
+        *str = out->str;
+        *len = out->str_len;
+    }
+    free(out);
+    return err;
+}
+
+static void reel_output_split_free(reel_output_split *split)
+{
+    free(split->children);
+    memset(split, 0, sizeof(reel_output_split));
+}
+
+/* return the output as a string, the caller must free it */
+static char *reel_output_csv(const reel_ctx *ctx, char delimiter)
+{
+    reel_output *out;
+    char *str = NULL;
+
+    if (!(out = calloc(1, sizeof(reel_output))))
+        return NULL;
+    out->fd = -1;
+    out->delimiter = delimiter;
+    if (reel_output_csv_rows(ctx, out))
+        free(out->str);
+    else if ((str = out->str))
+        str[out->str_len] = 0;
+    free(out);
+    return str;
+}
+
+/* write a table in the binary format, see REEL_TABLE_MAGIC */
+static reel_error reel_write_table(reel_ctx *ctx, const char *var_name, int fd)
+{
+    const reel_var *var = reel_find_var(ctx, var_name);
+    const reel_table *table;
+    reel_output *out;
+    reel_error err;
+    uint64_t i;
+
+    if (!(var && var->type == REEL_UINTTABLE && var->table_field))
+        return REEL_NOT_A_TABLE;
+    table = (const reel_table*)var->value;
+
+    if (!(out = calloc(1, sizeof(reel_output))))
+        return REEL_OUT_OF_MEMORY;
+    out->fd = fd;
+
+    reel_output_str(out, REEL_TABLE_MAGIC, sizeof(uint64_t));
+    reel_output_word(out, tdb_lexicon_size(ctx->db, var->table_field));
+    reel_output_word(out, reel_lexicon_fingerprint(ctx->db, var->table_field));
+    reel_output_word(out, table->num_pages);
+    for (i = 0; i < table->num_pages; i++)
+        if (table->pages[i] == reel_zero_page)
+            reel_output_char(out, (char)REEL_TABLE_ZERO_PAGE);
+        else
+            reel_output_char(out, REEL_PAGE_WIDTH(table->page_flags[i]));
+    reel_output_align(out);
+    for (i = 0; i < table->num_pages; i++)
+        if (table->pages[i] != reel_zero_page)
+            reel_output_str(out,
+                            table->pages[i],
+                            REEL_TABLE_PAGE_SIZE <<
+                            REEL_PAGE_WIDTH(table->page_flags[i]));
+    reel_output_flush(out);
+    err = out->error;
+    free(out);
+    return err;
+}
@@ -0,0 +1,258 @@
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/* quantile histograms */
+
+#define REEL_QUANTILES_GROUP_BITS\
+    (REEL_QUANTILES_SUB_BITS + 3) /* log2 of the size of a group in bytes */
+
+static inline uint32_t reel_quantiles_group(uint64_t val, uint32_t *bucket)
+{
+    uint32_t e;
+    if (val < REEL_QUANTILES_SUB_SIZE){
+        *bucket = val;
+        return 0;
+    }
+    e = 63 - __builtin_clzll(val);
+    *bucket = (val >> (e - REEL_QUANTILES_SUB_BITS)) - REEL_QUANTILES_SUB_SIZE;
+    return e - REEL_QUANTILES_SUB_BITS + 1;
+}
+
+/* the middle of the range of values in a bucket */
+static inline uint64_t reel_quantiles_bucket_value(uint32_t group,
+                                                   uint32_t bucket)
+{
+    uint64_t low;
+    if (!group)
+        return bucket;
+    low = (uint64_t)(REEL_QUANTILES_SUB_SIZE + bucket) << (group - 1);
+    return low + ((1ULL << (group - 1)) - 1) / 2;
+}
+
+static reel_quantiles *reel_quantiles_new(reel_arena *arena)
+{
+    reel_quantiles *q;
+    if ((q = reel_arena_calloc(arena, sizeof(reel_quantiles))))
+        q->arena = arena;
+    return q;
+}
+
+static void reel_quantiles_reset(reel_quantiles *q)
+{
+    uint32_t i;
+    for (i = 0; i < REEL_QUANTILES_GROUPS; i++)
+        if (q->groups[i])
+            reel_arena_free_chunk(q->arena,
+                                  q->groups[i],
+                                  REEL_QUANTILES_GROUP_BITS);
+    memset(q->groups, 0, sizeof(q->groups));
+    q->count = q->min = q->max = 0;
+}
+
+static inline uint64_t *reel_quantiles_alloc_group(reel_quantiles *q,
+                                                   uint32_t group)
+{
+    uint64_t *counts;
+    if ((counts = reel_arena_alloc_chunk(q->arena, REEL_QUANTILES_GROUP_BITS))){
+        memset(counts, 0, REEL_QUANTILES_SUB_SIZE * sizeof(uint64_t));
+        q->groups[group] = counts;
+    }
+    return counts;
+}
+
+static inline void reel_quantiles_add_range(reel_quantiles *q,
+                                            uint64_t count,
+                                            uint64_t min,
+                                            uint64_t max)
+{
+    if (!q->count || min < q->min)
+        q->min = min;
+    if (!q->count || max > q->max)
+        q->max = max;
+    q->count += count;
+}
+
+/* return -1 if out of memory */
+static inline int reel_quantiles_observe(reel_quantiles *q, uint64_t val)
+{
+    uint32_t bucket;
+    uint32_t group = reel_quantiles_group(val, &bucket);
+    uint64_t *counts = q->groups[group];
+
+    if (!counts && !(counts = reel_quantiles_alloc_group(q, group)))
+        return -1;
+    ++counts[bucket];
+    reel_quantiles_add_range(q, 1, val, val);
+    return 0;
+}
+
+/* add the counts of src to dst, return -1 if out of memory */
+static int reel_quantiles_merge(reel_quantiles *dst, const reel_quantiles *src)
+{
+    uint32_t i, j;
+
+    if (!src->count)
+        return 0;
+    for (i = 0; i < REEL_QUANTILES_GROUPS; i++){
+        const uint64_t *src_counts = src->groups[i];
+        uint64_t *counts = dst->groups[i];
+        if (!src_counts)
+            continue;
+        if (!counts && !(counts = reel_quantiles_alloc_group(dst, i)))
+            return -1;
+        for (j = 0; j < REEL_QUANTILES_SUB_SIZE; j++)
+            counts[j] += src_counts[j];
+    }
+    reel_quantiles_add_range(dst, src->count, src->min, src->max);
+    return 0;
+}
+
+static reel_quantiles *reel_quantiles_copy(reel_arena *arena,
+                                           const reel_quantiles *src)
+{
+    reel_quantiles *q;
+    if (!(q = reel_quantiles_new(arena)))
+        return NULL;
+    if (reel_quantiles_merge(q, src))
+        return NULL;
+    return q;
+}
+
+/* add src to the histogram of var, return -1 if out of memory */
+static int reel_quantiles_merge_var(reel_arena *arena,
+                                    reel_var *var,
+                                    const reel_quantiles *src)
+{
+    reel_quantiles *dst = (reel_quantiles*)var->value;
+    if (!src)
+        return 0;
+    if (!dst){
+        if (!(dst = reel_quantiles_new(arena)))
+            return -1;
+        var->value = (uintptr_t)dst;
+    }
+    return reel_quantiles_merge(dst, src);
+}
+
+/* the value at the given percentile, 0 < percentile <= 100 */
+static uint64_t reel_quantiles_value(const reel_quantiles *q, double percentile)
+{
+    uint64_t rank, n = 0;
+    uint32_t i, j;
+
+    if (!(q && q->count))
+        return 0;
+
+    rank = (uint64_t)ceil(percentile / 100. * q->count);
+    if (!rank)
+        rank = 1;
+    if (rank >= q->count)
+        return q->max;
+
+    for (i = 0; i < REEL_QUANTILES_GROUPS; i++){
+        const uint64_t *counts = q->groups[i];
+        if (!counts)
+            continue;
+        for (j = 0; j < REEL_QUANTILES_SUB_SIZE; j++)
+            if ((n += counts[j]) >= rank){
+                uint64_t val = reel_quantiles_bucket_value(i, j);
+                if (val < q->min)
+                    return q->min;
+                return val > q->max ? q->max: val;
+            }
+    }
+    return q->max;
+}
+
+/*
+Histograms are serialized as the count, min and max followed by a mask
+of the allocated groups and their counts.
+*/
+static int reel_quantiles_write(FILE *out, const reel_quantiles *q)
+{
+    uint64_t head[4] = {q->count, q->min, q->max, 0};
+    uint32_t i;
+
+    for (i = 0; i < REEL_QUANTILES_GROUPS; i++)
+        if (q->groups[i])
+            head[3] |= 1ULL << i;
+    if (fwrite(head, sizeof(uint64_t), 4, out) != 4)
+        return -1;
+    for (i = 0; i < REEL_QUANTILES_GROUPS; i++)
+        if (q->groups[i] && fwrite(q->groups[i],
+                                   sizeof(uint64_t),
+                                   REEL_QUANTILES_SUB_SIZE,
+                                   out) != REEL_QUANTILES_SUB_SIZE)
+            return -1;
+    return 0;
+}
+
+/* read a serialized histogram to an empty histogram */
+static int reel_quantiles_read(FILE *in, reel_quantiles *q)
+{
+    uint64_t head[4];
+    uint32_t i;
+
+    if (fread(head, sizeof(uint64_t), 4, in) != 4)
+        return -1;
+    for (i = 0; i < REEL_QUANTILES_GROUPS; i++)
+        if (head[3] & (1ULL << i)){
+            if (!reel_quantiles_alloc_group(q, i))
+                return -1;
+            if (fread(q->groups[i],
+                      sizeof(uint64_t),
+                      REEL_QUANTILES_SUB_SIZE,
+                      in) != REEL_QUANTILES_SUB_SIZE)
+                return -1;
+        }
+    q->count = head[0];
+    q->min = head[1];
+    q->max = head[2];
+    return 0;
+}
+
+static inline int reel_quantiles_observe_var(reel_ctx *ctx,
+                                             reel_var *var,
+                                             uint64_t val)
+{
+    reel_quantiles *q = (reel_quantiles*)var->value;
+
+    if (!q){
+        if (!(q = reel_quantiles_new(ctx->arena))){
+            ctx->error = REEL_OUT_OF_MEMORY;
+            return 0;
+        }
+        var->value = (uintptr_t)q;
+    }
+    if (reel_quantiles_observe(q, val)){
+        ctx->error = REEL_OUT_OF_MEMORY;
+        return 0;
+    }
+    return 1;
+}
+
+/* observe */
+
+static inline int reelfunc_observe_quantilesptr_uint(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t val){
+    return reel_quantiles_observe_var(ctx, var, val);
+}
+
+static inline int reelfunc_observe_quantilesptr_uintptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *val){
+    return reel_quantiles_observe_var(ctx, var, *val);
+}
+
+/* observe the difference of two values, typically timestamps */
+
+static inline int reelfunc_observe_quantilesptr_uint_uintptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t lval, uint64_t *rval){
+    return lval >= *rval && reel_quantiles_observe_var(ctx, var, lval - *rval);
+}
+
+static inline int reelfunc_observe_quantilesptr_uintptr_uintptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *lval, uint64_t *rval){
+    return *lval >= *rval && reel_quantiles_observe_var(ctx, var, *lval - *rval);
+}
+
+static inline int reelfunc_observe_quantilesptr_uintptr_uint(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *var, uint64_t *lval, uint64_t rval){
+    return *lval >= rval && reel_quantiles_observe_var(ctx, var, *lval - rval);
+}
@@ -3,9 +3,18 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #include <traildb.h>
 
@@ -13,25 +22,334 @@
 #include "reel_util.h"
 #include "thread_util.h"
 
+/*
+With --perf, each thread counts hardware events with a group of
+counters from perf_event_open, read at the boundaries of the phases of
+the query. Counters that can't be opened are left out, and if none
+can, --perf only prints a warning.
+*/
+enum perf_counter{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NUM_COUNTERS
+};
+
+enum query_phase{
+    PHASE_DECODE,
+    PHASE_EVAL,
+    PHASE_MERGE,
+    PHASE_OUTPUT,
+    NUM_PHASES
+};
+
+static const char *perf_counter_names[] = {
+    "cycles", "instructions", "cache_misses", "branch_misses", "dtlb_misses"
+};
+
+static const char *phase_names[] = {"decode", "eval", "merge", "output"};
+
+struct perf_group{
+    int leader;
+    int fds[PERF_NUM_COUNTERS];
+    /* position of each counter in the group, or -1 */
+    int index[PERF_NUM_COUNTERS];
+    int num_counters;
+};
+
+/*
+Counters of a shard for --progress and --stats. A shard updates its own
+counters after each trail with relaxed atomic stores and the reporter
+thread reads them with relaxed atomic loads, so the counters are
+aligned to a cache line to keep shards from contending.
+*/
+struct shard_stats{
+    uint64_t visited;
+    uint64_t trails;
+    uint64_t events;
+    uint64_t bytes;
+    uint64_t decode_ns;
+    uint64_t eval_ns;
+    uint64_t spill_ns;
+    uint64_t peak_memory;
+    /* not read before the shard is done */
+    uint64_t perf[PHASE_EVAL + 1][PERF_NUM_COUNTERS];
+} __attribute__((aligned(64)));
+
+#define CACHE_MAGIC "reel-cache 1\n"
+#define CACHE_SUFFIX ".reel"
+#define CACHE_DEFAULT_SIZE (1ULL << 30)
+/* temporary files left by crashed queries are deleted after a day */
+#define CACHE_STALE_SECONDS 86400
+
 struct job_arg{
     tdb *db;
     reel_script_ctx *ctx;
     uint64_t shard_idx;
     uint64_t start_trail;
     uint64_t end_trail;
-};
-
-struct selected_trail{
-    uint64_t trail_id;
-    struct tdb_event_filter *filter;
+    uint64_t num_spills;
+    struct shard_stats stats;
 };
 
 static long num_threads;
-static struct selected_trail *selected_trails;
+static const char *opt_select;
+static const char *opt_write_select;
+/* sorted trail IDs and their filters, see parse_select */
+static const uint64_t *selected_trails;
+static struct tdb_event_filter **selected_filters;
+static struct tdb_event_filter *select_filter;
 static uint64_t num_selected;
 static int show_progress;
+static int opt_stats;
+static int opt_perf;
+/* counters of the finished shards, see print_stats */
+static struct shard_stats *query_stats;
+static reel_fork_stats query_fork_stats;
+static uint64_t query_spills;
+static uint64_t query_start_ns;
+static uint64_t evaluate_ns;
+static uint64_t merge_ns;
+static reel_memory_usage merged_memory;
+/* counters of the main thread, which merges and outputs */
+static struct perf_group main_perf = {.leader = -1};
+/* counts of each phase, summed over threads */
+static uint64_t phase_perf[NUM_PHASES][PERF_NUM_COUNTERS];
 static uint64_t opt_before;
 static uint64_t opt_after;
+static uint64_t opt_max_memory;
+static int opt_no_spill;
+static const char *opt_spill_dir;
+static reel_output_options opt_output;
+static double opt_sample;
+static uint64_t opt_seed;
+static uint64_t sample_threshold;
+/* set when a shard has executed halt, read by all shards */
+static int halted;
+/* results are written to output_fd, a cache file with --cache */
+static int output_fd = STDOUT_FILENO;
+static const char *opt_cache_dir;
+static uint64_t opt_cache_size = CACHE_DEFAULT_SIZE;
+/* --set arguments as given, for the cache key */
+static char **cache_sets;
+static uint64_t num_cache_sets;
+/* the temporary cache file being written, removed at exit */
+static char cache_tmp_path[PATH_MAX];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* only the shard that owns counter writes it */
+static inline void add_stat(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t get_stat(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int perf_event_open(uint32_t type, uint64_t config, int group)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* open the counters of the calling thread, return -1 if none can be */
+static int perf_open(struct perf_group *g)
+{
+#ifdef __linux__
+    static const uint32_t types[] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE
+    };
+    static const uint64_t configs[] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_DTLB |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+#else
+    static const uint32_t types[PERF_NUM_COUNTERS];
+    static const uint64_t configs[PERF_NUM_COUNTERS];
+#endif
+    int i, fd;
+
+    g->leader = -1;
+    g->num_counters = 0;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++){
+        g->index[i] = -1;
+        if ((g->fds[i] = fd = perf_event_open(types[i], configs[i], g->leader)) == -1)
+            continue;
+        if (g->leader == -1)
+            g->leader = fd;
+        g->index[i] = g->num_counters++;
+    }
+    return g->leader == -1 ? -1: 0;
+}
+
+/* read the counters of a group, zero for counters that aren't open */
+static void perf_read(const struct perf_group *g,
+                      uint64_t values[PERF_NUM_COUNTERS])
+{
+    uint64_t buf[PERF_NUM_COUNTERS + 1];
+    int i;
+
+    memset(values, 0, PERF_NUM_COUNTERS * sizeof(uint64_t));
+    if (g->leader == -1 ||
+        read(g->leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t))
+        return;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        if (g->index[i] != -1 && g->index[i] < buf[0])
+            values[i] = buf[g->index[i] + 1];
+}
+
+/* add the counts between two readings to a phase */
+static void perf_add(uint64_t phase[PERF_NUM_COUNTERS],
+                     const uint64_t start[PERF_NUM_COUNTERS],
+                     const uint64_t end[PERF_NUM_COUNTERS])
+{
+    int i;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        phase[i] += end[i] - start[i];
+}
+
+static void perf_close(struct perf_group *g)
+{
+    int i;
+    if (g->leader == -1)
+        return;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        if (g->index[i] != -1)
+            close(g->fds[i]);
+    g->leader = -1;
+}
+
+static void spill(struct job_arg *arg)
+{
+    reel_error err;
+    uint64_t start = show_progress || opt_stats ? now_ns(): 0;
+    if ((err = reel_script_spill(arg->ctx, opt_spill_dir)))
+        DIE("[thread %lu] Spilling to %s failed: %s\n",
+            arg->shard_idx,
+            opt_spill_dir,
+            reel_error_str(err));
+    ++arg->num_spills;
+    if (start)
+        add_stat(&arg->stats.spill_ns, now_ns() - start);
+}
+
+/*
+Spill children when a shard uses more than its share of --max-memory,
+unless the children use less than half of it, so spilling them
+wouldn't help much.
+*/
+static int should_spill(const struct job_arg *arg)
+{
+    uint64_t mem = reel_script_memory(arg->ctx);
+    return mem > opt_max_memory / num_threads &&
+           reel_script_fork_memory(arg->ctx) * 2 > mem;
+}
+
+static const char *format_size(uint64_t size, char buf[32])
+{
+    if (size >= 1ULL << 30)
+        snprintf(buf, 32, "%.1fG", size / (double)(1ULL << 30));
+    else if (size >= 1ULL << 20)
+        snprintf(buf, 32, "%.1fM", size / (double)(1ULL << 20));
+    else
+        snprintf(buf, 32, "%.1fK", size / 1024.);
+    return buf;
+}
+
+/*
+With --no-spill, fail when a context uses more than its limit, naming
+the largest consumer of its memory: a fork statement and the children
+it created, or a table.
+*/
+static void die_memory_limit(const char *where,
+                             const reel_script_ctx *ctx,
+                             uint64_t other)
+{
+    reel_memory_usage usage;
+    char total[32], size[32];
+
+    reel_script_memory_usage(ctx, &usage);
+    format_size(usage.total + other, total);
+    if (usage.fork_line && usage.children >= usage.table_bytes)
+        DIE("%s Memory limit exceeded with %s: fork on line %u created "
+            "%lu children using %s\n",
+            where,
+            total,
+            usage.fork_line,
+            usage.fork_children,
+            format_size(usage.children, size));
+    if (usage.table_name)
+        DIE("%s Memory limit exceeded with %s: table %s uses %s\n",
+            where,
+            total,
+            usage.table_name,
+            format_size(usage.table_bytes, size));
+    DIE("%s Memory limit exceeded with %s\n", where, total);
+}
+
+/*
+Keep a shard within its share of --max-memory by spilling its children
+or, with --no-spill, fail once it uses more.
+*/
+static void limit_memory(struct job_arg *arg, const reel_event_buffer *buf)
+{
+    char where[32];
+
+    if (!opt_no_spill){
+        if (should_spill(arg))
+            spill(arg);
+    }else if (reel_script_memory(arg->ctx) + reel_event_buffer_memory(buf) >
+              opt_max_memory / num_threads){
+        snprintf(where, sizeof(where), "[thread %lu]", arg->shard_idx);
+        die_memory_limit(where, arg->ctx, reel_event_buffer_memory(buf));
+    }
+}
+
+/*
+--sample keeps a trail if a hash of its UUID and --seed is below the
+rate, so every run and every shard with the same seed picks the same
+trails.
+*/
+static inline int is_sampled(const tdb *db, uint64_t trail_id)
+{
+    uint64_t h[2];
+    memcpy(h, tdb_get_uuid(db, trail_id), sizeof(h));
+    h[0] = (h[0] ^ opt_seed) * 0x9E3779B97F4A7C15ULL;
+    h[0] = (h[0] ^ (h[0] >> 32) ^ h[1]) * 0xFF51AFD7ED558CCDULL;
+    h[0] = (h[0] ^ (h[0] >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    return (h[0] ^ (h[0] >> 33)) < sample_threshold;
+}
 
 static void *job_query_shard(void *arg0)
 {
@@ -39,65 +357,109 @@ static void *job_query_shard(void *arg0)
     const tdb_event **events;
     tdb_cursor *cursor = tdb_cursor_new(arg->db);
     reel_event_buffer *buf = reel_event_buffer_new();
-    uint64_t trail_id, num_events;
+    uint64_t i, trail_id, num_events, t0 = 0, t1 = 0;
+    uint64_t p0[PERF_NUM_COUNTERS], p1[PERF_NUM_COUNTERS];
+    const int collect_stats = show_progress || opt_stats;
+    struct perf_group perf = {.leader = -1};
     reel_error err;
 
     if (!(cursor && buf))
         DIE("Query shard out of memory\n");
-
-    for (trail_id = arg->start_trail; trail_id < arg->end_trail; trail_id++){
-        if (show_progress){
-            if (!((trail_id - arg->start_trail) & 65535)){
-                uint64_t perc = (100 * (trail_id - arg->start_trail)) /
-                                (arg->end_trail - arg->start_trail);
-                fprintf(stderr,
-                        "[thread %lu] %lu%% trails evaluated\n",
-                        arg->shard_idx, perc);
-            }
+    if (opt_perf)
+        perf_open(&perf);
+
+    /* with --select, shards are ranges of selected trails */
+    for (i = arg->start_trail; i < arg->end_trail; i++){
+        if (__atomic_load_n(&halted, __ATOMIC_RELAXED))
+            break;
+        trail_id = opt_select ? selected_trails[i]: i;
+        if (collect_stats){
+            add_stat(&arg->stats.visited, 1);
+            t0 = now_ns();
         }
 
+        if (sample_threshold && !is_sampled(arg->db, trail_id))
+            continue;
+
+        if (perf.leader != -1)
+            perf_read(&perf, p0);
+
         if (tdb_get_trail(cursor, trail_id))
             DIE("tdb_get_trail failed\n");
 
         if (!(events = reel_event_buffer_fill(buf, cursor, &num_events)))
             DIE("Event buffer out of memory\n");
+        if (collect_stats)
+            t1 = now_ns();
+        if (perf.leader != -1){
+            perf_read(&perf, p1);
+            perf_add(arg->stats.perf[PHASE_DECODE], p0, p1);
+        }
 
         if (num_events)
-            if ((err = reel_script_eval_trail(arg->ctx, events, num_events)))
-                DIE("[trail %"PRIu64"] Script failed: %s\n",
-                    trail_id,
-                    reel_error_str(err));
+            if ((err = reel_script_eval_trail(arg->ctx,
+                                              trail_id,
+                                              events,
+                                              num_events))){
+                char where[32];
+                snprintf(where, sizeof(where), "[trail %"PRIu64"]", trail_id);
+                if (err == REEL_MEMORY_LIMIT)
+                    die_memory_limit(where, arg->ctx, reel_event_buffer_memory(buf));
+                DIE("%s Script failed: %s\n", where, reel_error_str(err));
+            }
+
+        if (perf.leader != -1){
+            perf_read(&perf, p0);
+            perf_add(arg->stats.perf[PHASE_EVAL], p1, p0);
+        }
+        if (collect_stats){
+            uint64_t mem, t2 = now_ns();
+            add_stat(&arg->stats.trails, 1);
+            add_stat(&arg->stats.events, num_events);
+            add_stat(&arg->stats.bytes, reel_event_buffer_bytes(buf));
+            add_stat(&arg->stats.decode_ns, t1 - t0);
+            add_stat(&arg->stats.eval_ns, t2 - t1);
+            mem = reel_script_memory(arg->ctx) + reel_event_buffer_memory(buf);
+            if (mem > arg->stats.peak_memory)
+                __atomic_store_n(&arg->stats.peak_memory, mem, __ATOMIC_RELAXED);
+        }
+
+        if (reel_script_halted(arg->ctx))
+            __atomic_store_n(&halted, 1, __ATOMIC_RELAXED);
+
+        if (opt_max_memory)
+            limit_memory(arg, buf);
     }
-    if (show_progress)
-        fprintf(stderr,
-                "[thread %lu] 100%% trails evaluated\n",
-                arg->shard_idx);
 
+    /* children of a shard that has spilled are merged at output */
+    if (arg->num_spills)
+        spill(arg);
+
+    perf_close(&perf);
     reel_event_buffer_free(buf);
     tdb_cursor_free(cursor);
     return NULL;
 }
 
-static void apply_filters(tdb *db)
+/* set the filters of the selected trails of a shard */
+static void apply_filters(tdb *db, uint64_t start, uint64_t end)
 {
     uint64_t i;
-    struct tdb_event_filter *empty = tdb_event_filter_new_match_none();
-    tdb_opt_value value = {.ptr = empty};
-
-    if (!empty)
-        DIE("Couldn't allocate an empty filter\n");
-
-    if (tdb_set_opt(db, TDB_OPT_EVENT_FILTER, value))
-        DIE("Blacklisting trails failed\n");
+    tdb_opt_value value;
 
-    for (i = 0; i < num_selected; i++){
-        value.ptr = selected_trails[i].filter;
-        if (tdb_set_trail_opt(db,
-                              selected_trails[i].trail_id,
-                              TDB_OPT_EVENT_FILTER,
-                              value))
-            DIE("Setting a trail filter failed\n");
-    }
+    if (select_filter){
+        value.ptr = select_filter;
+        if (tdb_set_opt(db, TDB_OPT_EVENT_FILTER, value))
+            DIE("Setting a time range filter failed\n");
+    }else if (selected_filters)
+        for (i = start; i < end; i++){
+            value.ptr = selected_filters[i];
+            if (tdb_set_trail_opt(db,
+                                  selected_trails[i],
+                                  TDB_OPT_EVENT_FILTER,
+                                  value))
+                DIE("Setting a trail filter failed\n");
+        }
 }
 
 static void apply_time_slice(tdb *db)
@@ -120,20 +482,82 @@ static void apply_time_slice(tdb *db)
         DIE("Setting a time slice filter failed\n");
 }
 
+/*
+With --progress, a reporter thread sums the counters of all shards every
+PROGRESS_INTERVAL seconds and prints the progress of the whole query
+with its rates and estimated time to completion.
+*/
+#define PROGRESS_INTERVAL 2
+
+struct reporter{
+    const struct job_arg *args;
+    uint64_t num_trails;
+    uint64_t start_ns;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+};
+
+static void print_progress(const struct reporter *r)
+{
+    uint64_t i, visited = 0, events = 0;
+    double secs = (now_ns() - r->start_ns) / 1e9;
+    double rate;
+
+    for (i = 0; i < num_threads; i++){
+        visited += get_stat(&r->args[i].stats.visited);
+        events += get_stat(&r->args[i].stats.events);
+    }
+    rate = secs > 0 ? visited / secs: 0;
+    fprintf(stderr,
+            "%lu%% trails evaluated (%lu/%lu), %.0f trails/s, %.0f events/s",
+            r->num_trails ? 100 * visited / r->num_trails: 100,
+            visited,
+            r->num_trails,
+            rate,
+            secs > 0 ? events / secs: 0);
+    if (visited < r->num_trails && rate > 0)
+        fprintf(stderr, ", ETA %.0fs\n", (r->num_trails - visited) / rate);
+    else
+        fprintf(stderr, ", %.1fs\n", secs);
+}
+
+static void *report_progress(void *arg0)
+{
+    struct reporter *r = (struct reporter*)arg0;
+    struct timespec wakeup;
+
+    pthread_mutex_lock(&r->lock);
+    clock_gettime(CLOCK_REALTIME, &wakeup);
+    while (!r->done){
+        wakeup.tv_sec += PROGRESS_INTERVAL;
+        while (!r->done &&
+               pthread_cond_timedwait(&r->cond, &r->lock, &wakeup) != ETIMEDOUT);
+        if (!r->done)
+            print_progress(r);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
 static void evaluate(const tdb *db, reel_script_ctx *ctx, const char *tdb_path)
 {
-    uint64_t i, num_trails, trails_per_shard;
+    uint64_t i, num_trails, start = now_ns();
+    uint64_t p0[PERF_NUM_COUNTERS], p1[PERF_NUM_COUNTERS];
     struct job_arg *args;
     struct thread_job *jobs;
+    struct reporter reporter;
+    pthread_t reporter_thread;
 
-    num_trails = tdb_num_trails(db);
+    num_trails = opt_select ? num_selected: tdb_num_trails(db);
     if (num_threads > num_trails)
         num_threads = num_trails;
 
-    trails_per_shard = num_trails / num_threads;
-
-    if (!(args = calloc(num_threads, sizeof(struct job_arg))))
+    /* shard counters are aligned to cache lines */
+    if (!(args = aligned_alloc(__alignof__(struct job_arg),
+                               num_threads * sizeof(struct job_arg))))
         DIE("Couldn't allocate args\n");
+    memset(args, 0, num_threads * sizeof(struct job_arg));
 
     if (!(jobs = calloc(num_threads, sizeof(struct thread_job))))
         DIE("Couldn't allocate jobs\n");
@@ -143,39 +567,613 @@ static void evaluate(const tdb *db, reel_script_ctx *ctx, const char *tdb_path)
         if (tdb_open(args[i].db, tdb_path))
             DIE("Could not open tdb at %s\n", tdb_path);
 
-        if (selected_trails)
-            apply_filters(args[i].db);
+        args[i].shard_idx = i;
+        /* shards differ by at most one trail and cover all trails */
+        args[i].start_trail = i * num_trails / num_threads;
+        args[i].end_trail = (i + 1) * num_trails / num_threads;
+
+        if (opt_select)
+            apply_filters(args[i].db, args[i].start_trail, args[i].end_trail);
         else if (opt_after || opt_before)
             apply_time_slice(args[i].db);
 
         if (!(args[i].ctx = reel_script_clone(ctx, args[i].db, 0, 0)))
             DIE("Could not clone a Reel context. Out of memory?\n");
-
-        args[i].shard_idx = i;
-        args[i].start_trail = i * trails_per_shard;
-        args[i].end_trail = (i + 1) * trails_per_shard;
-        if (args[i].end_trail > num_trails)
-            args[i].end_trail = num_trails;
+        if (opt_no_spill)
+            reel_script_set_memory_limit(args[i].ctx, opt_max_memory / num_threads);
 
         jobs[i].arg = &args[i];
     }
 
+    if (show_progress){
+        reporter = (struct reporter){.args = args,
+                                     .num_trails = num_trails,
+                                     .start_ns = now_ns()};
+        pthread_mutex_init(&reporter.lock, NULL);
+        pthread_cond_init(&reporter.cond, NULL);
+        if (pthread_create(&reporter_thread, NULL, report_progress, &reporter))
+            DIE("Couldn't start the progress reporter\n");
+    }
+
     execute_jobs(job_query_shard, jobs, num_threads, num_threads);
 
+    if (show_progress){
+        pthread_mutex_lock(&reporter.lock);
+        reporter.done = 1;
+        pthread_cond_signal(&reporter.cond);
+        pthread_mutex_unlock(&reporter.lock);
+        pthread_join(reporter_thread, NULL);
+        print_progress(&reporter);
+    }
+    if (halted)
+        fprintf(stderr, "Query halted before evaluating all trails.\n");
+
+    if (!(query_stats = calloc(num_threads, sizeof(struct shard_stats))))
+        DIE("Couldn't allocate stats\n");
+    evaluate_ns = now_ns() - start;
+    start = now_ns();
+    perf_read(&main_perf, p0);
     for (i = 0; i < num_threads; i++){
+        const reel_fork_stats *fork_stats = reel_script_fork_stats(args[i].ctx);
         reel_error err = reel_script_merge(ctx, args[i].ctx, REEL_MERGE_ADD);
         if (err)
             DIE("Merging results failed: %s\n", reel_error_str(err));
+        query_fork_stats.activations += fork_stats->activations;
+        query_fork_stats.children_created += fork_stats->children_created;
+        query_stats[i] = args[i].stats;
+        query_spills += args[i].num_spills;
         reel_script_free(args[i].ctx);
         tdb_close(args[i].db);
+        if (opt_no_spill && reel_script_memory(ctx) > opt_max_memory)
+            die_memory_limit("[merge]", ctx, 0);
+    }
+    reel_script_memory_usage(ctx, &merged_memory);
+    merge_ns = now_ns() - start;
+    perf_read(&main_perf, p1);
+    perf_add(phase_perf[PHASE_MERGE], p0, p1);
+    free(args);
+    free(jobs);
+}
+
+/* counts of a phase as a JSON object, ipc if both counts are known */
+static void print_perf(const uint64_t values[PERF_NUM_COUNTERS])
+{
+    int i, n = 0;
+
+    fprintf(stderr, "{");
+    for (i = 0; i < PERF_NUM_COUNTERS; i++)
+        if (main_perf.index[i] != -1)
+            fprintf(stderr,
+                    "%s\"%s\": %lu",
+                    n++ ? ", ": "",
+                    perf_counter_names[i],
+                    values[i]);
+    if (main_perf.index[PERF_CYCLES] != -1 &&
+        main_perf.index[PERF_INSTRUCTIONS] != -1 &&
+        values[PERF_CYCLES])
+        fprintf(stderr,
+                ", \"ipc\": %.2f",
+                values[PERF_INSTRUCTIONS] / (double)values[PERF_CYCLES]);
+    fprintf(stderr, "}");
+}
+
+static void print_stats(uint64_t output_ns)
+{
+    struct shard_stats total = {0};
+    uint64_t i;
+    int j;
+
+    for (i = 0; query_stats && i < num_threads; i++){
+        for (j = 0; j < PERF_NUM_COUNTERS; j++){
+            phase_perf[PHASE_DECODE][j] += query_stats[i].perf[PHASE_DECODE][j];
+            phase_perf[PHASE_EVAL][j] += query_stats[i].perf[PHASE_EVAL][j];
+        }
+        total.trails += query_stats[i].trails;
+        total.events += query_stats[i].events;
+        total.bytes += query_stats[i].bytes;
+        total.decode_ns += query_stats[i].decode_ns;
+        total.eval_ns += query_stats[i].eval_ns;
+        total.spill_ns += query_stats[i].spill_ns;
+        if (query_stats[i].peak_memory > total.peak_memory)
+            total.peak_memory = query_stats[i].peak_memory;
+    }
+    fprintf(stderr,
+            "{\"threads\": %ld, \"trails\": %lu, \"events\": %lu, "
+            "\"bytes_copied\": %lu, \"fork_activations\": %lu, "
+            "\"children_created\": %lu, \"spills\": %lu, \"halted\": %s,\n"
+            " \"seconds\": {\"total\": %.3f, \"evaluate\": %.3f, "
+            "\"decode\": %.3f, \"eval\": %.3f, \"spill\": %.3f, "
+            "\"merge\": %.3f, \"output\": %.3f},\n"
+            " \"memory\": {\"peak_shard\": %lu, \"merged\": %lu, \"tables\": %lu, "
+            "\"children\": %lu, \"num_children\": %lu},\n",
+            num_threads,
+            total.trails,
+            total.events,
+            total.bytes,
+            query_fork_stats.activations,
+            query_fork_stats.children_created,
+            query_spills,
+            halted ? "true": "false",
+            (now_ns() - query_start_ns) / 1e9,
+            evaluate_ns / 1e9,
+            total.decode_ns / 1e9,
+            total.eval_ns / 1e9,
+            total.spill_ns / 1e9,
+            merge_ns / 1e9,
+            output_ns / 1e9,
+            total.peak_memory,
+            merged_memory.total,
+            merged_memory.tables,
+            merged_memory.children,
+            merged_memory.num_children);
+    if (opt_perf){
+        fprintf(stderr, " \"perf\": {");
+        for (j = 0; j < NUM_PHASES; j++){
+            fprintf(stderr, "%s\"%s\": ", j ? ", ": "", phase_names[j]);
+            print_perf(phase_perf[j]);
+        }
+        fprintf(stderr, "},\n");
+    }
+    fprintf(stderr, " \"shards\": [");
+    for (i = 0; query_stats && i < num_threads; i++){
+        fprintf(stderr,
+                "%s\n  {\"trails\": %lu, \"events\": %lu, \"decode\": %.3f, "
+                "\"eval\": %.3f, \"spill\": %.3f, \"peak_memory\": %lu",
+                i ? ",": "",
+                query_stats[i].trails,
+                query_stats[i].events,
+                query_stats[i].decode_ns / 1e9,
+                query_stats[i].eval_ns / 1e9,
+                query_stats[i].spill_ns / 1e9,
+                query_stats[i].peak_memory);
+        if (opt_perf)
+            for (j = PHASE_DECODE; j <= PHASE_EVAL; j++){
+                fprintf(stderr, ", \"%s_perf\": ", phase_names[j]);
+                print_perf(query_stats[i].perf[j]);
+            }
+        fprintf(stderr, "}");
+    }
+    fprintf(stderr, "]}\n");
+}
+
+/*
+Output is formatted in parts, num_threads parts at a time in parallel,
+and each batch of parts is written in order before the next one is
+formatted, so only a batch is kept in memory.
+*/
+#define OUTPUT_PARTS_PER_THREAD 4
+
+struct output_arg{
+    const reel_output_split *split;
+    uint32_t part;
+    char *str;
+    uint64_t len;
+};
+
+static void *job_output_part(void *arg0)
+{
+    struct output_arg *arg = (struct output_arg*)arg0;
+    reel_error err;
+
+    if ((err = reel_script_output_part(arg->split,
+                                       arg->part,
+                                       &arg->str,
+                                       &arg->len)))
+        DIE("Couldn't output results: %s\n", reel_error_str(err));
+    return NULL;
+}
+
+static void *write_output_parts(struct thread_job *jobs,
+                                uint32_t num_jobs,
+                                void *reduce_ctx)
+{
+    struct iovec iov[num_jobs];
+    struct iovec *next = iov;
+    uint32_t i, n = num_jobs;
+
+    for (i = 0; i < num_jobs; i++){
+        const struct output_arg *arg = (const struct output_arg*)jobs[i].arg;
+        iov[i].iov_base = arg->str;
+        iov[i].iov_len = arg->len;
+    }
+    while (n && !*(reel_error*)reduce_ctx){
+        ssize_t len = writev(output_fd, next, n);
+        if (len < 0){
+            if (errno != EINTR)
+                *(reel_error*)reduce_ctx = REEL_OUTPUT_FAILED;
+            continue;
+        }
+        for (; n && (size_t)len >= next->iov_len; ++next, --n)
+            len -= next->iov_len;
+        if (n){
+            next->iov_base = (char*)next->iov_base + len;
+            next->iov_len -= len;
+        }
+    }
+    for (i = 0; i < num_jobs; i++)
+        free(((struct output_arg*)jobs[i].arg)->str);
+    return reduce_ctx;
+}
+
+static reel_error output(const reel_script_ctx *ctx)
+{
+    reel_output_split split;
+    struct output_arg *args;
+    struct thread_job *jobs;
+    reel_error err;
+    uint32_t i;
+
+    if (num_threads < 2)
+        return reel_script_output_fd(ctx, output_fd, &opt_output);
+
+    if ((err = reel_script_output_split(ctx,
+                                        &opt_output,
+                                        num_threads * OUTPUT_PARTS_PER_THREAD,
+                                        &split)))
+        return err;
+
+    if (split.num_parts == 1){
+        reel_script_output_split_free(&split);
+        return reel_script_output_fd(ctx, output_fd, &opt_output);
+    }
+
+    if (!(args = calloc(split.num_parts, sizeof(struct output_arg))))
+        DIE("Couldn't allocate args\n");
+
+    if (!(jobs = calloc(split.num_parts, sizeof(struct thread_job))))
+        DIE("Couldn't allocate jobs\n");
+
+    for (i = 0; i < split.num_parts; i++){
+        args[i].split = &split;
+        args[i].part = i;
+        jobs[i].arg = &args[i];
     }
+
+    execute_jobs_with_reduce(job_output_part,
+                             write_output_parts,
+                             jobs,
+                             &err,
+                             split.num_parts,
+                             num_threads);
+
+    reel_script_output_split_free(&split);
     free(args);
     free(jobs);
+    return err;
+}
+
+/*
+Results cache: with --cache DIR, the output of a query is stored in DIR
+under a hash of a key that identifies the query, and a later query
+with the same key prints the stored output without evaluating the
+script. The key consists of
+
+- a hash of the reel_query executable, which contains the script,
+- the arguments that change the results, normalized: --set values by
+  variable, files given with --set var=@file and --select by a hash of
+  their contents, and --after and --before as timestamps,
+- the identity of the TrailDB: its path, inode, size and modification
+  time, and its numbers of trails, events and fields and time range.
+
+Each file starts with the key, which is compared in full on a hit, so
+that a collision of hashes is a miss. Files are replaced by renaming,
+so concurrent queries never read a partial file. A query that fails
+or is interrupted removes its temporary file at exit. Hits update the
+modification time of the file, and when the files grow over
+--cache-size, the least recently used ones are deleted along with
+temporary files older than CACHE_STALE_SECONDS.
+*/
+struct cache_entry{
+    char *name;
+    uint64_t size;
+    struct timespec mtime;
+};
+
+static uint64_t hash_bytes(uint64_t h, const void *data, uint64_t len)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    uint64_t i;
+    /* FNV-1a */
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h;
 }
 
-static char *open_file(const char *arg, const char *path){
+static uint64_t hash_file(const char *path)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+    char buf[65536];
+    ssize_t len;
     int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        DIE("Could not open file '%s' for --cache\n", path);
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        h = hash_bytes(h, buf, len);
+    if (len < 0)
+        DIE("Could not read file '%s' for --cache\n", path);
+    close(fd);
+    return h;
+}
+
+static int compare_set_args(const char *x, const char *y)
+{
+    size_t xlen = strcspn(x, "=");
+    size_t ylen = strcspn(y, "=");
+    int cmp = memcmp(x, y, xlen < ylen ? xlen: ylen);
+    return cmp ? cmp: (xlen > ylen) - (xlen < ylen);
+}
+
+static char *cache_key(const tdb *db, const char *tdb_path, const char *exe)
+{
+    char *key = NULL;
+    size_t len = 0;
+    char path[PATH_MAX];
+    char tdb_file[PATH_MAX];
     struct stat stats;
+    FILE *out;
+    uint64_t i, j;
+
+    if (!(out = open_memstream(&key, &len)))
+        DIE("Couldn't allocate the cache key\n");
+
+    fprintf(out, "exe %016lx\n", hash_file(exe));
+
+    /* tdb_open also accepts the path of a .tdb file without the suffix */
+    snprintf(tdb_file, PATH_MAX, "%s.tdb", tdb_path);
+    if (realpath(tdb_path, path) || realpath(tdb_file, path)){
+        if (stat(path, &stats))
+            DIE("Could not read tdb at %s\n", tdb_path);
+        fprintf(out,
+                "tdb %s %lu %lu %lu %lu.%09lu\n",
+                path,
+                (uint64_t)stats.st_dev,
+                (uint64_t)stats.st_ino,
+                (uint64_t)stats.st_size,
+                (uint64_t)stats.st_mtim.tv_sec,
+                (uint64_t)stats.st_mtim.tv_nsec);
+    }else
+        fprintf(out, "tdb %s\n", tdb_path);
+    fprintf(out,
+            "tdb %lu %lu %lu %lu %lu\n",
+            tdb_num_trails(db),
+            tdb_num_events(db),
+            tdb_num_fields(db),
+            tdb_min_timestamp(db),
+            tdb_max_timestamp(db));
+
+    /* sort by variable, keeping the order of the values of a variable */
+    for (i = 1; i < num_cache_sets; i++){
+        char *arg = cache_sets[i];
+        for (j = i; j && compare_set_args(cache_sets[j - 1], arg) > 0; j--)
+            cache_sets[j] = cache_sets[j - 1];
+        cache_sets[j] = arg;
+    }
+    for (i = 0; i < num_cache_sets; i++){
+        const char *val = strchr(cache_sets[i], '=');
+        if (!val)
+            continue;
+        if (val[1] == '@')
+            fprintf(out,
+                    "set %.*s @%016lx\n",
+                    (int)(val - cache_sets[i]),
+                    cache_sets[i],
+                    hash_file(&val[2]));
+        else
+            fprintf(out, "set %zu %s\n", strlen(cache_sets[i]), cache_sets[i]);
+    }
+    if (opt_select)
+        fprintf(out, "select %016lx\n", hash_file(opt_select));
+    /* ids and variables that are set, not added, depend on the shards */
+    fprintf(out,
+            "threads %ld\n"
+            "range %lu %lu\n"
+            "sample %.17g %lu %.17g\n"
+            "output %d %d %lu %zu %s\n",
+            num_threads,
+            opt_after,
+            opt_before,
+            opt_sample,
+            opt_seed,
+            opt_output.scale,
+            opt_output.format,
+            opt_output.descending,
+            opt_output.limit,
+            opt_output.order_by ? strlen(opt_output.order_by): 0,
+            opt_output.order_by ? opt_output.order_by: "");
+    if (fclose(out))
+        DIE("Couldn't allocate the cache key\n");
+    return key;
+}
+
+static void cache_path(char *path, const char *key, const char *prefix)
+{
+    uint64_t h = hash_bytes(0xCBF29CE484222325ULL, key, strlen(key));
+    if (snprintf(path,
+                 PATH_MAX,
+                 "%s/%s%016lx%s",
+                 opt_cache_dir,
+                 prefix,
+                 h,
+                 *prefix ? ".XXXXXX": CACHE_SUFFIX) >= PATH_MAX)
+        DIE("Path of --cache is too long\n");
+}
+
+static void copy_output(int fd, uint64_t offset, uint64_t size)
+{
+    char buf[65536];
+
+    while (size){
+        ssize_t n = pread(fd, buf, size < sizeof(buf) ? size: sizeof(buf), offset);
+        ssize_t written = 0;
+        if (n <= 0)
+            DIE("Couldn't read the cached results\n");
+        while (written < n){
+            ssize_t w = write(STDOUT_FILENO, &buf[written], n - written);
+            if (w < 0 && errno != EINTR)
+                DIE("Couldn't output results: %s\n",
+                    reel_error_str(REEL_OUTPUT_FAILED));
+            if (w > 0)
+                written += w;
+        }
+        offset += n;
+        size -= n;
+    }
+}
+
+/* print the cached results of key and return 1, or return 0 if not cached */
+static int cache_lookup(const char *key)
+{
+    char path[PATH_MAX];
+    uint64_t head_len = strlen(CACHE_MAGIC) + strlen(key) + 1;
+    char *head;
+    struct stat stats;
+    int fd;
+
+    cache_path(path, key, "");
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return 0;
+    if (fstat(fd, &stats) || (uint64_t)stats.st_size < head_len){
+        close(fd);
+        return 0;
+    }
+    if (!(head = malloc(head_len)))
+        DIE("Couldn't allocate the cache key\n");
+    if (pread(fd, head, head_len, 0) != (ssize_t)head_len ||
+        memcmp(head, CACHE_MAGIC, strlen(CACHE_MAGIC)) ||
+        memcmp(&head[strlen(CACHE_MAGIC)], key, head_len - strlen(CACHE_MAGIC))){
+        free(head);
+        close(fd);
+        return 0;
+    }
+    free(head);
+    copy_output(fd, head_len, stats.st_size - head_len);
+    /* mark the file as recently used */
+    futimens(fd, NULL);
+    close(fd);
+    return 1;
+}
+
+static void remove_cache_tmp(void)
+{
+    if (cache_tmp_path[0])
+        unlink(cache_tmp_path);
+}
+
+static void remove_cache_tmp_on_signal(int sig)
+{
+    remove_cache_tmp();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* open a temporary cache file for the results of key and write the key */
+static int cache_create(const char *key)
+{
+    uint64_t key_len = strlen(key) + 1;
+    char path[PATH_MAX];
+    int fd;
+
+    cache_path(path, key, ".");
+    if ((fd = mkstemp(path)) == -1)
+        DIE("Could not create a file in --cache %s: %s\n",
+            opt_cache_dir,
+            strerror(errno));
+    memcpy(cache_tmp_path, path, sizeof(path));
+    atexit(remove_cache_tmp);
+    signal(SIGINT, remove_cache_tmp_on_signal);
+    signal(SIGTERM, remove_cache_tmp_on_signal);
+    signal(SIGHUP, remove_cache_tmp_on_signal);
+    if (write(fd, CACHE_MAGIC, strlen(CACHE_MAGIC)) != strlen(CACHE_MAGIC) ||
+        write(fd, key, key_len) != (ssize_t)key_len)
+        DIE("Could not write to --cache %s\n", opt_cache_dir);
+    return fd;
+}
+
+static int compare_cache_entries(const void *a, const void *b)
+{
+    const struct cache_entry *x = (const struct cache_entry*)a;
+    const struct cache_entry *y = (const struct cache_entry*)b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1: 1;
+    if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+        return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1: 1;
+    return 0;
+}
+
+/* delete the least recently used files until the cache fits in --cache-size */
+static void cache_evict(void)
+{
+    struct cache_entry *entries = NULL;
+    uint64_t i, num_entries = 0, size = 0, total = 0;
+    time_t stale = time(NULL) - CACHE_STALE_SECONDS;
+    struct dirent *d;
+    DIR *dir;
+
+    if (!(dir = opendir(opt_cache_dir)))
+        return;
+    while ((d = readdir(dir))){
+        size_t len = strlen(d->d_name);
+        struct stat stats;
+        /* temporary files are named .HASH.XXXXXX, see cache_path */
+        if (len == 24 &&
+            d->d_name[0] == '.' &&
+            d->d_name[17] == '.' &&
+            !fstatat(dirfd(dir), d->d_name, &stats, 0) &&
+            stats.st_mtime < stale)
+            unlinkat(dirfd(dir), d->d_name, 0);
+        if (len <= strlen(CACHE_SUFFIX) ||
+            d->d_name[0] == '.' ||
+            strcmp(&d->d_name[len - strlen(CACHE_SUFFIX)], CACHE_SUFFIX) ||
+            fstatat(dirfd(dir), d->d_name, &stats, 0))
+            continue;
+        if (num_entries == size){
+            size = size ? size * 2: 64;
+            if (!(entries = realloc(entries, size * sizeof(struct cache_entry))))
+                DIE("Couldn't allocate cache entries\n");
+        }
+        if (!(entries[num_entries].name = strdup(d->d_name)))
+            DIE("Couldn't allocate cache entries\n");
+        entries[num_entries].size = stats.st_size;
+        entries[num_entries].mtime = stats.st_mtim;
+        total += stats.st_size;
+        ++num_entries;
+    }
+    qsort(entries, num_entries, sizeof(struct cache_entry), compare_cache_entries);
+    for (i = 0; i < num_entries; i++){
+        if (total > opt_cache_size &&
+            !unlinkat(dirfd(dir), entries[i].name, 0))
+            total -= entries[i].size;
+        free(entries[i].name);
+    }
+    free(entries);
+    closedir(dir);
+}
+
+/* store the results written to fd under key, see cache_create */
+static void cache_store(const char *key, int fd)
+{
+    char path[PATH_MAX];
+    uint64_t head_len = strlen(CACHE_MAGIC) + strlen(key) + 1;
+    struct stat stats;
+
+    if (fstat(fd, &stats))
+        DIE("Could not write to --cache %s\n", opt_cache_dir);
+    copy_output(fd, head_len, stats.st_size - head_len);
+    cache_path(path, key, "");
+    /* results of a halted query depend on the timing of threads */
+    if (!halted && !close(fd) && !rename(cache_tmp_path, path)){
+        cache_tmp_path[0] = 0;
+        cache_evict();
+    }
+}
+
+/* map a file read-only, the caller unmaps it */
+static const char *map_file(const char *arg, const char *path, uint64_t *size)
+{
+    int fd;
+    struct stat stats;
+    const char *p;
 
     if ((fd = open(path, O_RDONLY)) == -1)
         DIE("Could not open file '%s' for variable '%s'", path, arg);
@@ -183,24 +1181,26 @@ static char *open_file(const char *arg, const char *path){
     if (fstat(fd, &stats))
         DIE("Could not read file '%s' for variable '%s'", path, arg);
 
-    if (stats.st_size){
-        char *ret;
-        char *p = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
-        if (p == MAP_FAILED)
-            DIE("Could not read file '%s' for variable '%s'", path, arg);
-        close(fd);
-        if (!(ret = calloc(1, stats.st_size + 1)))
-            DIE("Out of memory\n");
-        memcpy(ret, p, stats.st_size);
-        munmap(p, stats.st_size);
-        return ret;
-    }else
+    if (!stats.st_size)
         DIE("File '%s' for variable '%s' is empty", path, arg);
+
+    p = mmap(NULL, stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        DIE("Could not read file '%s' for variable '%s'", path, arg);
+    close(fd);
+    *size = stats.st_size;
+    return p;
 }
 
+/*
+Values in files are parsed from the mapped file without copying it.
+Binary tables are used in place, so they stay mapped until exit.
+*/
 static void set_var(reel_script_ctx *ctx, const char *arg)
 {
     char *val;
+    const char *data;
+    uint64_t size;
     reel_parse_error err;
 
     if (!(val = strchr(arg, '=')))
@@ -208,10 +1208,20 @@ static void set_var(reel_script_ctx *ctx, const char *arg)
 
     *val = 0;
     ++val;
-    if (val[0] == '@')
-        val = open_file(arg, &val[1]);
+    if (val[0] == '@'){
+        data = map_file(arg, &val[1], &size);
+        if (size >= strlen(REEL_TABLE_MAGIC) &&
+            !memcmp(data, REEL_TABLE_MAGIC, strlen(REEL_TABLE_MAGIC)))
+            err = reel_script_map_table(ctx, arg, data, size);
+        else{
+            madvise((void*)data, size, MADV_SEQUENTIAL);
+            err = reel_script_parse_var_len(ctx, arg, data, size);
+            munmap((void*)data, size);
+        }
+    }else
+        err = reel_script_parse_var(ctx, arg, val);
 
-    if ((err = reel_script_parse_var(ctx, arg, val)) < 0)
+    if (err < 0)
         DIE("Could not set variable '%s': %s\n",
             arg,
             reel_parse_error_str(err));
@@ -222,6 +1232,26 @@ static void set_var(reel_script_ctx *ctx, const char *arg)
                 reel_parse_error_str(err));
 }
 
+/* write a table set with --set in the binary format */
+static void write_table(reel_script_ctx *ctx, char *arg)
+{
+    char *path;
+    reel_error err;
+    int fd;
+
+    if (!(path = strchr(arg, '=')))
+        DIE("Invalid argument '%s'\n", arg);
+    *path = 0;
+    ++path;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        DIE("Could not open file '%s' for table '%s'\n", path, arg);
+    if ((err = reel_script_write_table(ctx, arg, fd)))
+        DIE("Could not write table '%s': %s\n", arg, reel_error_str(err));
+    if (close(fd))
+        DIE("Could not write table '%s' to '%s'\n", arg, path);
+}
+
 static void print_usage_and_exit()
 {
     fprintf(stderr,
@@ -233,15 +1263,46 @@ static void print_usage_and_exit()
 "OPTIONS:\n"
 "-s --set var=value      Set a variable in the Reel script.\n"
 "                        Use var=@filename to read value from a file.\n"
-"-T --threads N          Use N parallel threads to execute the query.\n"
+"   --write-table var=filename\n"
+"                        Write a table set by a preceding --set to filename\n"
+"                        in a binary format and exit. The file can be used\n"
+"                        with --set var=@filename with the same TrailDB.\n"
+"-T --threads N          Use N parallel threads to execute the query and\n"
+"                        to format large outputs.\n"
 "-S --select trailspec   Query limited time ranges on select trails (see below).\n"
-"-P --progress           Print progress to stderr.\n"
+"-P --progress           Print the progress of the query, with rates and\n"
+"                        the estimated time left, to stderr.\n"
+"   --stats              Print statistics of the query, like trails, events\n"
+"                        and time spent decoding, evaluating and merging,\n"
+"                        as JSON to stderr.\n"
+"   --perf               Add hardware counters of each phase and thread,\n"
+"                        like cycles and cache misses, to --stats.\n"
 "   --after T            Only consider events with a timestamp >= T.\n"
 "                        Prefix T with '+' to make time relative to the\n"
 "                        minimum time in the db.\n"
 "   --before T           Only consider events with a timestamp < T.\n"
 "                        Prefix T with '+' to make time relative to the\n"
 "                        minimum time in the db.\n"
+"   --max-memory SIZE    Spill forked contexts to disk when the query uses\n"
+"                        more than SIZE bytes (suffixes K, M and G).\n"
+"   --spill-dir DIR      Write spill files to DIR (default: $TMPDIR or /tmp).\n"
+"   --no-spill           Fail instead of spilling when the query uses more\n"
+"                        than --max-memory, naming what uses the memory.\n"
+"   --format FORMAT      Output results as csv (default) or columnar, a binary\n"
+"                        format with a column per output (see reel_io.c).\n"
+"   --order-by COLUMN    Output rows in the ascending order of COLUMN, named\n"
+"                        as in the CSV header.\n"
+"   --desc               Output rows in the descending order of COLUMN.\n"
+"   --limit N            Output only the first N rows.\n"
+"   --sample RATE        Query only a fraction RATE (0 < RATE <= 1) of trails,\n"
+"                        chosen by a hash of their UUID.\n"
+"   --seed S             Choose a different sample of trails (default: 0).\n"
+"   --scale              Scale uints, tables and funnels by 1 / RATE to\n"
+"                        estimate totals of all trails.\n"
+"   --cache DIR          Store results in DIR and print the stored results\n"
+"                        of an identical query instead of evaluating it.\n"
+"   --cache-size SIZE    Delete the least recently used results when DIR\n"
+"                        grows over SIZE bytes (default: 1G).\n"
 "\n"
 "Trailspec:\n"
 "You can query a subset of trails, or query a chosen time range of select\n"
@@ -249,7 +1310,10 @@ static void print_usage_and_exit()
 "specifies trails to be selected, identified by a UUID, and optionally a\n"
 "start time and an optional end time for the trail in each line:\n\n"
 "[32-char hex-encoded UUID] <[start-time] [end-time]>\n\n"
-"Unknown UUIDs are ignored.\n"
+"Unknown UUIDs are ignored. Large trailspecs are parsed with --threads\n"
+"threads. --write-select FILE writes the trails selected by --select to FILE\n"
+"in a binary format and exits. The file can be given to --select with the\n"
+"same TrailDB. It can't have time ranges.\n"
 "\n");
     exit(1);
 }
@@ -264,68 +1328,360 @@ uint64_t safely_to_uint(const char *str, const char *field)
     return x;
 }
 
-static void parse_select(const char *fname, const tdb *db)
-{
-    FILE *in;
-    size_t n = 0;
-    ssize_t line_len;
-    char *line = NULL;
-    uint8_t uuid[16];
-    uint64_t num_lines = 0;
+/*
+Trailspecs of --select are parsed in parallel, a chunk of lines per
+thread, and indexed by trail ID. Trails with the same time range share
+a filter. If all selected trails have the same range, or none, it is
+set for the whole db instead of for each trail.
 
-    if (!(in = fopen(fname, "r")))
-        DIE("Could not open trailspec in %s\n", fname);
+A binary trailspec, as written with --write-select, is "REELSEL1", the
+number of trails and their sorted trail IDs as 64-bit integers. It is
+used in place and selects whole trails.
+*/
+#define SELECT_MAGIC "REELSEL1"
+#define SELECT_MIN_CHUNK_SIZE (1 << 20)
 
-    while ((line_len = getline(&line, &n, in)) != -1)
-        ++num_lines;
+struct select_line{
+    uint64_t trail_id;
+    uint64_t start_time;
+    uint64_t end_time;
+};
+
+struct select_chunk{
+    const tdb *db;
+    const char *start;
+    const char *end;
+    struct select_line *lines;
+    uint64_t num_lines;
+    uint64_t num_unknown;
+};
 
-    if (!(selected_trails = malloc(num_lines * sizeof(struct selected_trail))))
-        DIE("Couldn't allocated selected trails\n");
+struct time_range{
+    uint64_t start_time;
+    uint64_t end_time;
+    struct tdb_event_filter *filter;
+};
 
-    rewind(in);
-    while ((line_len = getline(&line, &n, in)) != -1){
-        if (line[line_len - 1] == '\n')
-            line[line_len - 1] = 0;
+static struct time_range *time_ranges;
+static uint64_t time_ranges_mask;
+static uint64_t num_time_ranges;
 
-        char *p = NULL;
-        char *uuidstr = strtok_r(line, " ", &p);
-        char *startstr = strtok_r(NULL, " ", &p);
-        char *endstr = strtok_r(NULL, " ", &p);
-        uint64_t start_time = 0;
-        uint64_t end_time = TDB_MAX_TIMEDELTA + 1;
-        uint64_t trail_id;
-        struct tdb_event_filter *filter;
+static const char *next_token(const char **p, const char *end, uint64_t *len)
+{
+    const char *token;
+    while (*p < end && **p == ' ')
+        ++*p;
+    token = *p;
+    while (*p < end && **p != ' ')
+        ++*p;
+    *len = *p - token;
+    return *len ? token: NULL;
+}
 
-        if (tdb_uuid_raw((const uint8_t*)uuidstr, uuid))
-            DIE("Invalid UUID: %s\n", uuidstr);
+static uint64_t token_to_uint(const char *token, uint64_t len, const char *field)
+{
+    char buf[32];
+    if (len >= sizeof(buf))
+        DIE("Invalid %s: %.*s", field, (int)len, token);
+    memcpy(buf, token, len);
+    buf[len] = 0;
+    return safely_to_uint(buf, field);
+}
 
-        if (tdb_get_trail_id(db, uuid, &trail_id))
+static void *job_parse_select(void *arg0)
+{
+    struct select_chunk *chunk = (struct select_chunk*)arg0;
+    const char *p = chunk->start;
+    uint64_t size = 0;
+    uint8_t uuid[16];
+    uint8_t hex[33] = {0};
+
+    while (p < chunk->end){
+        const char *eol = memchr(p, '\n', chunk->end - p);
+        const char *uuidstr, *startstr, *endstr;
+        uint64_t uuid_len, start_len, end_len, trail_id;
+        struct select_line *l;
+
+        if (!eol)
+            eol = chunk->end;
+        uuidstr = next_token(&p, eol, &uuid_len);
+        startstr = next_token(&p, eol, &start_len);
+        endstr = next_token(&p, eol, &end_len);
+        p = eol + 1;
+
+        if (!uuidstr)
+            continue;
+        if (uuid_len != 32)
+            DIE("Invalid UUID: %.*s\n", (int)uuid_len, uuidstr);
+        /* the mapped file is not zero-terminated */
+        memcpy(hex, uuidstr, 32);
+        if (tdb_uuid_raw(hex, uuid))
+            DIE("Invalid UUID: %s\n", (const char*)hex);
+        if (tdb_get_trail_id(chunk->db, uuid, &trail_id)){
+            ++chunk->num_unknown;
             continue;
+        }
 
+        if (chunk->num_lines == size){
+            size = size ? size * 2: 1024;
+            if (!(chunk->lines = realloc(chunk->lines,
+                                         size * sizeof(struct select_line))))
+                DIE("Couldn't allocate selected trails\n");
+        }
+        l = &chunk->lines[chunk->num_lines++];
+        l->trail_id = trail_id;
+        l->start_time = 0;
+        l->end_time = TDB_MAX_TIMEDELTA + 1;
         if (startstr){
-            start_time = safely_to_uint(startstr, "start time");
+            l->start_time = token_to_uint(startstr, start_len, "start time");
             if (endstr)
-                end_time = safely_to_uint(endstr, "end time");
+                l->end_time = token_to_uint(endstr, end_len, "end time");
         }
+    }
+    return NULL;
+}
+
+/* return the filter shared by trails with the given time range */
+static struct tdb_event_filter *range_filter(uint64_t start_time,
+                                             uint64_t end_time)
+{
+    uint64_t i;
+    struct time_range *r;
+
+    if (num_time_ranges * 2 >= time_ranges_mask){
+        struct time_range *old = time_ranges;
+        uint64_t old_size = old ? time_ranges_mask + 1: 0;
+        time_ranges_mask = old ? old_size * 2 - 1: 63;
+        if (!(time_ranges = calloc(time_ranges_mask + 1,
+                                   sizeof(struct time_range))))
+            DIE("Couldn't allocate time ranges\n");
+        for (i = 0; i < old_size; i++){
+            uint64_t j;
+            if (!old[i].filter)
+                continue;
+            j = (old[i].start_time * 31 + old[i].end_time) * 0x9E3779B97F4A7C15ULL;
+            for (j >>= 32; time_ranges[j & time_ranges_mask].filter; j++);
+            time_ranges[j & time_ranges_mask] = old[i];
+        }
+        free(old);
+    }
+
+    i = (start_time * 31 + end_time) * 0x9E3779B97F4A7C15ULL;
+    for (i >>= 32;; i++){
+        r = &time_ranges[i & time_ranges_mask];
+        if (!r->filter)
+            break;
+        if (r->start_time == start_time && r->end_time == end_time)
+            return r->filter;
+    }
+    if (!(r->filter = tdb_event_filter_new()))
+        DIE("Creating an event filter failed. Out of memory?\n");
+    if (tdb_event_filter_add_time_range(r->filter, start_time, end_time))
+        DIE("Filter add time range failed (start %lu end %lu). Out of memory?\n",
+            start_time,
+            end_time);
+    r->start_time = start_time;
+    r->end_time = end_time;
+    ++num_time_ranges;
+    return r->filter;
+}
+
+/*
+sort lines by trail ID with a stable LSD radix sort of 8-bit digits, so
+that lines of the same trail keep their order in the file. Only the
+digits up to the largest trail ID are sorted. Returns lines or tmp,
+whichever holds the result.
+*/
+static struct select_line *sort_select_lines(struct select_line *lines,
+                                             struct select_line *tmp,
+                                             uint64_t num_lines,
+                                             uint64_t max_trail_id)
+{
+    uint64_t i, shift, counts[256];
+
+    for (shift = 0; shift < 64 && max_trail_id >> shift; shift += 8){
+        struct select_line *swap;
+        uint64_t offset = 0;
+
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < num_lines; i++)
+            ++counts[(lines[i].trail_id >> shift) & 255];
+        for (i = 0; i < 256; i++){
+            uint64_t count = counts[i];
+            counts[i] = offset;
+            offset += count;
+        }
+        for (i = 0; i < num_lines; i++)
+            tmp[counts[(lines[i].trail_id >> shift) & 255]++] = lines[i];
+        swap = lines;
+        lines = tmp;
+        tmp = swap;
+    }
+    return lines;
+}
+
+static void parse_select_binary(const char *fname,
+                                const tdb *db,
+                                const char *data,
+                                uint64_t size)
+{
+    const uint64_t *head = (const uint64_t*)data;
+    uint64_t i;
+
+    if (size < 2 * sizeof(uint64_t) ||
+        (size - 2 * sizeof(uint64_t)) / sizeof(uint64_t) < head[1])
+        DIE("Invalid binary trailspec in %s\n", fname);
+
+    selected_trails = &head[2];
+    num_selected = head[1];
+    for (i = 0; i < num_selected; i++)
+        if (selected_trails[i] >= tdb_num_trails(db) ||
+            (i && selected_trails[i] <= selected_trails[i - 1]))
+            DIE("Binary trailspec in %s doesn't match the TrailDB\n", fname);
+}
 
-        if (!(filter = tdb_event_filter_new()))
-            DIE("Creating an event filter failed. Out of memory?\n");
-        if (tdb_event_filter_add_time_range(filter, start_time, end_time))
-            DIE("Filter add time range failed (start %lu end %lu filter index %lu). Out of memory?\n", start_time, end_time, num_selected);
+static void parse_select(const char *fname, const tdb *db)
+{
+    int fd;
+    struct stat stats;
+    const char *data, *p, *end;
+    struct select_chunk *chunks;
+    struct thread_job *jobs;
+    struct select_line *lines, *sorted, *tmp;
+    uint64_t i, n, size, num_chunks, num_lines = 0, num_unknown = 0;
+    uint64_t max_trail_id = 0;
+    uint64_t *trails;
+    int is_shared = 1;
+
+    if ((fd = open(fname, O_RDONLY)) == -1 || fstat(fd, &stats))
+        DIE("Could not open trailspec in %s\n", fname);
+    if (!(size = stats.st_size)){
+        close(fd);
+        return;
+    }
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        DIE("Could not read trailspec in %s\n", fname);
+    close(fd);
+
+    if (size >= strlen(SELECT_MAGIC) &&
+        !memcmp(data, SELECT_MAGIC, strlen(SELECT_MAGIC))){
+        parse_select_binary(fname, db, data, size);
+        return;
+    }
+
+    /* split the file at line boundaries */
+    num_chunks = size / SELECT_MIN_CHUNK_SIZE;
+    if (num_chunks > num_threads)
+        num_chunks = num_threads;
+    if (!num_chunks)
+        num_chunks = 1;
+    if (!(chunks = calloc(num_chunks, sizeof(struct select_chunk))))
+        DIE("Couldn't allocate chunks\n");
+    if (!(jobs = calloc(num_chunks, sizeof(struct thread_job))))
+        DIE("Couldn't allocate jobs\n");
+
+    for (p = data, end = data + size, i = 0; i < num_chunks; i++){
+        const char *chunk_end = data + (i + 1) * size / num_chunks;
+        if (chunk_end < p)
+            chunk_end = p;
+        if (chunk_end < end && (chunk_end = memchr(chunk_end, '\n', end - chunk_end)))
+            ++chunk_end;
+        else
+            chunk_end = end;
+        chunks[i].db = db;
+        chunks[i].start = p;
+        chunks[i].end = p = chunk_end;
+        jobs[i].arg = &chunks[i];
+    }
+    if (num_chunks > 1)
+        execute_jobs(job_parse_select, jobs, num_chunks, num_chunks);
+    else
+        job_parse_select(&chunks[0]);
 
-        selected_trails[num_selected].trail_id = trail_id;
-        selected_trails[num_selected].filter = filter;
-        ++num_selected;
+    munmap((void*)data, size);
+    for (i = 0; i < num_chunks; i++){
+        num_lines += chunks[i].num_lines;
+        num_unknown += chunks[i].num_unknown;
     }
 
+    /* concatenate the chunks in file order */
+    if (!(lines = malloc((num_lines + 1) * sizeof(struct select_line))) ||
+        !(tmp = malloc((num_lines + 1) * sizeof(struct select_line))))
+        DIE("Couldn't allocate selected trails\n");
+    for (n = 0, i = 0; i < num_chunks; i++){
+        uint64_t j;
+        for (j = 0; j < chunks[i].num_lines; j++)
+            if (chunks[i].lines[j].trail_id > max_trail_id)
+                max_trail_id = chunks[i].lines[j].trail_id;
+        memcpy(&lines[n],
+               chunks[i].lines,
+               chunks[i].num_lines * sizeof(struct select_line));
+        n += chunks[i].num_lines;
+        free(chunks[i].lines);
+    }
+    free(chunks);
+    free(jobs);
+
+    /* a trail listed more than once gets the last time range */
+    sorted = sort_select_lines(lines, tmp, num_lines, max_trail_id);
+    for (n = 0, i = 0; i < num_lines; i++){
+        if (i + 1 < num_lines && sorted[i + 1].trail_id == sorted[i].trail_id)
+            continue;
+        sorted[n] = sorted[i];
+        if (sorted[n].start_time != sorted[0].start_time ||
+            sorted[n].end_time != sorted[0].end_time)
+            is_shared = 0;
+        ++n;
+    }
+    if (sorted != lines){
+        free(lines);
+        lines = sorted;
+    }else
+        free(tmp);
+
+    if (!(trails = malloc((n + 1) * sizeof(uint64_t))))
+        DIE("Couldn't allocate selected trails\n");
+    for (i = 0; i < n; i++)
+        trails[i] = lines[i].trail_id;
+
+    if (n && is_shared){
+        if (lines[0].start_time || lines[0].end_time != TDB_MAX_TIMEDELTA + 1)
+            select_filter = range_filter(lines[0].start_time, lines[0].end_time);
+    }else if (n){
+        if (!(selected_filters = malloc(n * sizeof(struct tdb_event_filter*))))
+            DIE("Couldn't allocate selected filters\n");
+        for (i = 0; i < n; i++)
+            selected_filters[i] = range_filter(lines[i].start_time,
+                                               lines[i].end_time);
+    }
+    free(lines);
+
+    selected_trails = trails;
+    num_selected = n;
+
     fprintf(stderr,
             "Total trails: %lu Selected trails: %lu Unknown UUIDs: %lu\n",
             tdb_num_trails(db),
             num_selected,
-            num_lines - num_selected);
+            num_unknown);
+}
 
-    free(line);
-    fclose(in);
+/* write the selected trails as a binary trailspec */
+static void write_select(const char *fname)
+{
+    FILE *out;
+    uint64_t head[2] = {0, num_selected};
+
+    if (select_filter || selected_filters)
+        DIE("Binary trailspecs can't have time ranges\n");
+    memcpy(head, SELECT_MAGIC, sizeof(uint64_t));
+    if (!(out = fopen(fname, "w")))
+        DIE("Could not open %s\n", fname);
+    if (fwrite(head, sizeof(uint64_t), 2, out) != 2 ||
+        fwrite(selected_trails, sizeof(uint64_t), num_selected, out) != num_selected ||
+        fclose(out))
+        DIE("Could not write %s\n", fname);
 }
 
 static uint64_t parse_time(const tdb *db, const char *arg, const char *label)
@@ -337,6 +1693,41 @@ static uint64_t parse_time(const tdb *db, const char *arg, const char *label)
         return safely_to_uint(arg, label) + 1;
 }
 
+static uint64_t parse_size(const char *arg, const char *label)
+{
+    char *end = NULL;
+    uint64_t size = strtoull(arg, &end, 10);
+
+    switch (*end){
+        case 'G':
+        case 'g':
+            size <<= 10;
+            /* fall through */
+        case 'M':
+        case 'm':
+            size <<= 10;
+            /* fall through */
+        case 'K':
+        case 'k':
+            size <<= 10;
+            ++end;
+    }
+    if (end == arg || *end || !size)
+        DIE("Invalid %s: %s\n", label, arg);
+    return size;
+}
+
+static double parse_rate(const char *arg, const char *label)
+{
+    char *end;
+    double rate;
+    errno = 0;
+    rate = strtod(arg, &end);
+    if (errno || end == arg || *end || !(rate > 0 && rate <= 1))
+        DIE("Invalid %s: %s\n", label, arg);
+    return rate;
+}
+
 static void initialize(reel_script_ctx *ctx,
                        const tdb *db,
                        int argc,
@@ -349,6 +1740,22 @@ static void initialize(reel_script_ctx *ctx,
         {"progress", no_argument, 0, 'P'},
         {"after", required_argument, 0, -2},
         {"before", required_argument, 0, -3},
+        {"max-memory", required_argument, 0, -4},
+        {"spill-dir", required_argument, 0, -5},
+        {"format", required_argument, 0, -6},
+        {"order-by", required_argument, 0, -7},
+        {"desc", no_argument, 0, -8},
+        {"limit", required_argument, 0, -9},
+        {"write-table", required_argument, 0, -10},
+        {"write-select", required_argument, 0, -11},
+        {"sample", required_argument, 0, -12},
+        {"seed", required_argument, 0, -13},
+        {"scale", no_argument, 0, -14},
+        {"stats", no_argument, 0, -15},
+        {"perf", no_argument, 0, -16},
+        {"no-spill", no_argument, 0, -17},
+        {"cache", required_argument, 0, -18},
+        {"cache-size", required_argument, 0, -19},
         {0, 0, 0, 0}
     };
 
@@ -367,13 +1774,17 @@ static void initialize(reel_script_ctx *ctx,
             case -1:
                 break;
             case 's':
+                if (!(cache_sets = realloc(cache_sets,
+                                           (num_cache_sets + 1) * sizeof(char*))) ||
+                    !(cache_sets[num_cache_sets++] = strdup(optarg)))
+                    DIE("Couldn't allocate --set arguments\n");
                 set_var(ctx, optarg);
                 break;
             case 'T':
                 num_threads = safely_to_uint(optarg, "number of threads");
                 break;
             case 'S':
-                parse_select(optarg, db);
+                opt_select = optarg;
                 break;
             case 'P':
                 show_progress = 1;
@@ -384,20 +1795,107 @@ static void initialize(reel_script_ctx *ctx,
             case -3: /* before */
                 opt_before = parse_time(db, optarg, "before");
                 break;
+            case -4: /* max-memory */
+                opt_max_memory = parse_size(optarg, "max memory");
+                break;
+            case -5: /* spill-dir */
+                opt_spill_dir = optarg;
+                break;
+            case -6: /* format */
+                if (!strcmp(optarg, "columnar"))
+                    opt_output.format = REEL_FORMAT_COLUMNAR;
+                else if (strcmp(optarg, "csv"))
+                    DIE("Unknown output format: %s\n", optarg);
+                break;
+            case -7: /* order-by */
+                opt_output.order_by = optarg;
+                break;
+            case -8: /* desc */
+                opt_output.descending = 1;
+                break;
+            case -9: /* limit */
+                opt_output.limit = safely_to_uint(optarg, "limit");
+                break;
+            case -10: /* write-table */
+                write_table(ctx, optarg);
+                exit(0);
+            case -11: /* write-select */
+                opt_write_select = optarg;
+                break;
+            case -12: /* sample */
+                opt_sample = parse_rate(optarg, "sample rate");
+                break;
+            case -13: /* seed */
+                opt_seed = safely_to_uint(optarg, "seed");
+                break;
+            case -14: /* scale */
+                opt_output.scale = 1;
+                break;
+            case -15: /* stats */
+                opt_stats = 1;
+                break;
+            case -16: /* perf */
+                opt_stats = opt_perf = 1;
+                break;
+            case -17: /* no-spill */
+                opt_no_spill = 1;
+                break;
+            case -18: /* cache */
+                opt_cache_dir = optarg;
+                break;
+            case -19: /* cache-size */
+                opt_cache_size = parse_size(optarg, "cache size");
+                break;
             default:
                 print_usage_and_exit();
         }
     }while (c != -1);
 
-    if (selected_trails && (opt_before || opt_after))
+    if (opt_select && (opt_before || opt_after))
         DIE("Specifying both --select and --after or --before is not supported.\n");
+
+    if (opt_select)
+        parse_select(opt_select, db);
+
+    if (opt_write_select){
+        if (!opt_select)
+            DIE("--write-select requires --select\n");
+        write_select(opt_write_select);
+        exit(0);
+    }
+
+    if (opt_sample && opt_sample < 1)
+        sample_threshold = (uint64_t)(opt_sample * 18446744073709551616.);
+    if (opt_output.scale && opt_sample)
+        opt_output.scale = 1 / opt_sample;
+    else if (opt_output.scale)
+        DIE("--scale requires --sample\n");
+
+    if (opt_no_spill && !opt_max_memory)
+        DIE("--no-spill requires --max-memory\n");
+
+    if (opt_perf && perf_open(&main_perf)){
+        fprintf(stderr,
+                "Hardware counters are not available: %s\n",
+                strerror(errno));
+        opt_perf = 0;
+    }
+
+    if (!opt_spill_dir && !(opt_spill_dir = getenv("TMPDIR")))
+        opt_spill_dir = "/tmp";
 }
 
 int main(int argc, char **argv)
 {
     tdb *db = tdb_init();
     tdb_error err;
+    reel_error output_err;
     const char *path;
+    char *key = NULL;
+    uint64_t output_start;
+    uint64_t p0[PERF_NUM_COUNTERS], p1[PERF_NUM_COUNTERS];
+
+    query_start_ns = now_ns();
 
     if (argc < 2)
         print_usage_and_exit();
@@ -411,17 +1909,52 @@ int main(int argc, char **argv)
         DIE("Couldn't initialize the Reel script. Out of memory?\n");
     initialize(ctx, db, argc, argv);
 
+    if (opt_cache_dir){
+#ifdef __linux__
+        key = cache_key(db, path, "/proc/self/exe");
+#else
+        key = cache_key(db, path, argv[0]);
+#endif
+        if (cache_lookup(key)){
+            if (opt_stats)
+                fprintf(stderr,
+                        "{\"cache\": \"hit\", \"seconds\": {\"total\": %.3f}}\n",
+                        (now_ns() - query_start_ns) / 1e9);
+            goto done;
+        }
+        output_fd = cache_create(key);
+    }
+
     /*
     if --select was enabled but no trails match,
     we don't need to eval anything
     */
-    if (!(selected_trails && !num_selected))
+    if (!(opt_select && !num_selected))
         evaluate(db, ctx, path);
     else
         fprintf(stderr, "No trails match --select. No query executed.\n");
 
-    printf("%s\n", reel_script_output_csv(ctx, ','));
-
+    fflush(stdout);
+    output_start = now_ns();
+    perf_read(&main_perf, p0);
+    output_err = output(ctx);
+    perf_read(&main_perf, p1);
+    perf_add(phase_perf[PHASE_OUTPUT], p0, p1);
+    if (!output_err &&
+        opt_output.format == REEL_FORMAT_CSV &&
+        write(output_fd, "\n", 1) != 1)
+        output_err = REEL_OUTPUT_FAILED;
+    if (output_err)
+        DIE("Couldn't output results: %s\n", reel_error_str(output_err));
+    if (key)
+        cache_store(key, output_fd);
+    if (opt_stats)
+        print_stats(now_ns() - output_start);
+
+done:
+    free(key);
+    perf_close(&main_perf);
+    free(query_stats);
     reel_script_free(ctx);
     tdb_close(db);
     return 0;
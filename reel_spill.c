@@ -0,0 +1,374 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+spill: children of a root context can be written to a run file, sorted
+by key, and freed. Runs are merged with the children in memory at output
+time with the semantics of REEL_MERGE_ADD (see reel_spill_merge).
+
+A run is a sequence of children, each a key followed by the values of
+all variables in order. Const tables are skipped, other tables are
+stored as index-value pairs of non-zero values, terminated by
+REEL_SPILL_END. Sketches, bitmaps, histograms and funnel counts are a
+byte telling if they exist followed by their contents. Runs are
+temporary files in the native byte order.
+*/
+
+#define REEL_SPILL_END UINT64_MAX
+#define REEL_SPILL_BUFFER_SIZE (1 << 20)
+#define REEL_SPILL_MAX_RUNS 64
+
+/* memory used by the children of a root context */
+static uint64_t reel_fork_memory(const reel_ctx *ctx)
+{
+    const reel_fork_map *map = &ctx->forks;
+    uint64_t i, size = map->children_size * sizeof(reel_fork_entry);
+
+    if (ctx->fork_arena)
+        size += ctx->fork_arena->num_bytes;
+    if (map->table)
+        size += (map->table_mask + 1) * sizeof(reel_fork_entry);
+    for (i = 0; i < map->num_fields; i++)
+        size += map->num_items[i] * sizeof(void*);
+    return size;
+}
+
+static uint64_t reel_memory(const reel_ctx *ctx)
+{
+    return ctx->arena->num_bytes + reel_fork_memory(ctx);
+}
+
+/*
+Memory of a root context by consumer. fork_lines gives the line of the
+fork statement of each function index, or zero for other functions.
+*/
+static void reel_memory_usage_of(const reel_ctx *ctx,
+                                 const uint32_t *fork_lines,
+                                 reel_memory_usage *usage)
+{
+    uint64_t i, size;
+
+    memset(usage, 0, sizeof(reel_memory_usage));
+    usage->total = reel_memory(ctx);
+    usage->children = reel_fork_memory(ctx);
+    usage->num_children = ctx->forks.num_children;
+
+    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+        const reel_var *v = &ctx->vars[i];
+        if (v->type != REEL_UINTTABLE || !v->value)
+            continue;
+        size = reel_table_memory((const reel_table*)v->value);
+        usage->tables += size;
+        if (size > usage->table_bytes){
+            usage->table_name = v->name;
+            usage->table_bytes = size;
+        }
+    }
+    for (i = 0; ctx->fork_counts && i < sizeof(ctx->funcstate) / sizeof(void*); i++)
+        if (fork_lines[i] && ctx->fork_counts[i] > usage->fork_children){
+            usage->fork_line = fork_lines[i];
+            usage->fork_children = ctx->fork_counts[i];
+        }
+}
+
+static int reel_spill_write_ctx(FILE *out, uint64_t key, const reel_ctx *ctx)
+{
+    const uint64_t end = REEL_SPILL_END;
+    uint64_t i, j, k;
+
+    if (fwrite(&key, sizeof(uint64_t), 1, out) != 1)
+        return -1;
+
+    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+        const reel_var *v = &ctx->vars[i];
+        const reel_table *table;
+
+        switch (v->type){
+            case REEL_UINT:
+            case REEL_ITEM:
+                if (fwrite(&v->value, sizeof(uint64_t), 1, out) != 1)
+                    return -1;
+                break;
+            case REEL_UINTTABLE:
+                if (!v->table_field || (v->flags & REEL_FLAG_IS_CONST))
+                    break;
+                table = (const reel_table*)v->value;
+                for (j = 0; j < table->num_pages; j++){
+                    const void *page = table->pages[j];
+                    reel_table_width w = REEL_PAGE_WIDTH(table->page_flags[j]);
+                    if (page == reel_zero_page)
+                        continue;
+                    for (k = 0; k < REEL_TABLE_PAGE_SIZE; k++){
+                        uint64_t pair[2];
+                        if (!(pair[1] = reel_page_get(page, w, k)))
+                            continue;
+                        pair[0] = (j << REEL_TABLE_PAGE_BITS) | k;
+                        if (fwrite(pair, sizeof(uint64_t), 2, out) != 2)
+                            return -1;
+                    }
+                }
+                if (fwrite(&end, sizeof(uint64_t), 1, out) != 1)
+                    return -1;
+                break;
+            case REEL_HLL:
+                if (fputc(v->value ? 1: 0, out) == EOF)
+                    return -1;
+                if (v->value && fwrite((const void*)v->value,
+                                       sizeof(reel_hll),
+                                       1,
+                                       out) != 1)
+                    return -1;
+                break;
+            case REEL_BITMAP:
+                if (fputc(v->value ? 1: 0, out) == EOF)
+                    return -1;
+                if (v->value && reel_bitmap_write(out, (const reel_bitmap*)v->value))
+                    return -1;
+                break;
+            case REEL_QUANTILES:
+                if (fputc(v->value ? 1: 0, out) == EOF)
+                    return -1;
+                if (v->value &&
+                    reel_quantiles_write(out, (const reel_quantiles*)v->value))
+                    return -1;
+                break;
+            case REEL_FUNNEL:
+                if (fputc(v->value ? 1: 0, out) == EOF)
+                    return -1;
+                if (v->value && fwrite((const void*)v->value,
+                                       sizeof(uint64_t),
+                                       v->funnel->num_steps,
+                                       out) != v->funnel->num_steps)
+                    return -1;
+                break;
+        }
+    }
+    return 0;
+}
+
+/* return 1 if a key was read, 0 at the end of the run and -1 on error */
+static int reel_spill_read_key(FILE *in, uint64_t *key)
+{
+    if (fread(key, sizeof(uint64_t), 1, in) == 1)
+        return 1;
+    return ferror(in) ? -1: 0;
+}
+
+/* read the variables following a key to ctx, whose variables are zero */
+static int reel_spill_read_vars(FILE *in, reel_ctx *ctx)
+{
+    uint64_t i;
+
+    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+        reel_var *v = &ctx->vars[i];
+        uint64_t pair[2];
+
+        switch (v->type){
+            case REEL_UINT:
+            case REEL_ITEM:
+                if (fread(&v->value, sizeof(uint64_t), 1, in) != 1)
+                    return -1;
+                break;
+            case REEL_UINTTABLE:
+                if (!v->table_field || (v->flags & REEL_FLAG_IS_CONST))
+                    break;
+                while (1){
+                    if (fread(pair, sizeof(uint64_t), 1, in) != 1)
+                        return -1;
+                    if (pair[0] == REEL_SPILL_END)
+                        break;
+                    if (pair[0] >= v->table_length ||
+                        fread(&pair[1], sizeof(uint64_t), 1, in) != 1)
+                        return -1;
+                    if (reel_table_store((reel_table*)v->value,
+                                         pair[0],
+                                         pair[1]))
+                        return -1;
+                }
+                break;
+            case REEL_HLL:
+                if ((pair[0] = fgetc(in)) == 1){
+                    if (!v->value &&
+                        !(v->value = (uintptr_t)reel_hll_new(ctx->arena, NULL)))
+                        return -1;
+                    if (fread((void*)v->value, sizeof(reel_hll), 1, in) != 1)
+                        return -1;
+                }else if (pair[0])
+                    return -1;
+                break;
+            case REEL_BITMAP:
+                if ((pair[0] = fgetc(in)) == 1){
+                    if (!v->value &&
+                        !(v->value = (uintptr_t)reel_bitmap_new(ctx->arena)))
+                        return -1;
+                    if (reel_bitmap_read(in, (reel_bitmap*)v->value))
+                        return -1;
+                }else if (pair[0])
+                    return -1;
+                break;
+            case REEL_QUANTILES:
+                if ((pair[0] = fgetc(in)) == 1){
+                    if (!v->value &&
+                        !(v->value = (uintptr_t)reel_quantiles_new(ctx->arena)))
+                        return -1;
+                    if (reel_quantiles_read(in, (reel_quantiles*)v->value))
+                        return -1;
+                }else if (pair[0])
+                    return -1;
+                break;
+            case REEL_FUNNEL:
+                if ((pair[0] = fgetc(in)) == 1){
+                    if (!v->value &&
+                        !(v->value = (uintptr_t)reel_arena_alloc(ctx->arena,
+                            v->funnel->num_steps * sizeof(uint64_t))))
+                        return -1;
+                    if (fread((void*)v->value,
+                              sizeof(uint64_t),
+                              v->funnel->num_steps,
+                              in) != v->funnel->num_steps)
+                        return -1;
+                }else if (pair[0])
+                    return -1;
+                break;
+        }
+    }
+    return 0;
+}
+
+/* zero all variables that are not const */
+static void reel_reset_vars(reel_ctx *ctx)
+{
+    uint64_t i;
+    for (i = 0; i < sizeof(ctx->vars) / sizeof(reel_var); i++){
+        reel_var *v = &ctx->vars[i];
+        if (v->type == REEL_UINTTABLE){
+            if (v->table_field && !(v->flags & REEL_FLAG_IS_CONST))
+                reel_table_reset((reel_table*)v->value);
+        }else if (v->type == REEL_HLL){
+            /* keep the memory of sketches for reuse */
+            if (v->value)
+                memset((void*)v->value, 0, sizeof(reel_hll));
+        }else if (v->type == REEL_BITMAP){
+            if (v->value)
+                reel_bitmap_reset((reel_bitmap*)v->value);
+        }else if (v->type == REEL_QUANTILES){
+            if (v->value)
+                reel_quantiles_reset((reel_quantiles*)v->value);
+        }else if (v->type == REEL_FUNNEL){
+            if (v->value)
+                memset((void*)v->value, 0, v->funnel->num_steps * sizeof(uint64_t));
+        }else
+            v->value = 0;
+    }
+}
+
+static int reel_spill_add_run(reel_spill *spill, FILE *run)
+{
+    FILE **runs;
+    if (!(runs = realloc(spill->runs, (spill->num_runs + 1) * sizeof(FILE*))))
+        return -1;
+    runs[spill->num_runs++] = run;
+    spill->runs = runs;
+    return 0;
+}
+
+/*
+Open a new run in dir. The file is unlinked right away, so it
+disappears when it is closed.
+*/
+static FILE *reel_spill_open(const char *dir)
+{
+    FILE *run = NULL;
+    char *path;
+    int fd;
+
+    if (!(path = malloc(strlen(dir) + 20)))
+        return NULL;
+    sprintf(path, "%s/reel-spill-XXXXXX", dir);
+    if ((fd = mkstemp(path)) != -1){
+        unlink(path);
+        if (!(run = fdopen(fd, "w+")))
+            close(fd);
+        else
+            setvbuf(run, NULL, _IOFBF, REEL_SPILL_BUFFER_SIZE);
+    }
+    free(path);
+    return run;
+}
+
+/* write all children of a root context to a new run and free them */
+static reel_error reel_spill_children(reel_ctx *ctx, const char *dir)
+{
+    uint64_t i;
+    reel_fork_entry *sorted = NULL;
+    reel_error err = REEL_SPILL_FAILED;
+    FILE *run;
+
+    if (ctx != ctx->root)
+        return REEL_MERGE_NOT_PARENT;
+    if (!ctx->forks.num_children)
+        return 0;
+    if (!(run = reel_spill_open(dir)))
+        return REEL_SPILL_FAILED;
+
+    if (!(sorted = reel_fork_sorted(&ctx->forks))){
+        err = REEL_OUT_OF_MEMORY;
+        goto error;
+    }
+    for (i = 0; i < ctx->forks.num_children; i++)
+        if (reel_spill_write_ctx(run, sorted[i].key, sorted[i].child))
+            goto error;
+    if (fflush(run))
+        goto error;
+    if (reel_spill_add_run(&ctx->spill, run)){
+        err = REEL_OUT_OF_MEMORY;
+        goto error;
+    }
+    ctx->spill.dir = dir;
+    free(sorted);
+
+    reel_fork_free(&ctx->forks);
+    reel_arena_free(ctx->fork_arena);
+    ctx->fork_arena = NULL;
+    return 0;
+error:
+    free(sorted);
+    fclose(run);
+    return err;
+}
+
+/* add the runs of src to dst, src keeps its own handles */
+static reel_error reel_spill_copy_runs(reel_spill *dst, const reel_spill *src)
+{
+    uint64_t i;
+    if (!dst->dir)
+        dst->dir = src->dir;
+    for (i = 0; i < src->num_runs; i++){
+        FILE *run;
+        int fd;
+        if ((fd = dup(fileno(src->runs[i]))) == -1)
+            return REEL_SPILL_FAILED;
+        if (!(run = fdopen(fd, "r"))){
+            close(fd);
+            return REEL_SPILL_FAILED;
+        }
+        setvbuf(run, NULL, _IOFBF, REEL_SPILL_BUFFER_SIZE);
+        if (reel_spill_add_run(dst, run)){
+            fclose(run);
+            return REEL_OUT_OF_MEMORY;
+        }
+    }
+    return 0;
+}
+
+static void reel_spill_free(reel_spill *spill)
+{
+    uint64_t i;
+    for (i = 0; i < spill->num_runs; i++)
+        fclose(spill->runs[i]);
+    free(spill->runs);
+    memset(spill, 0, sizeof(reel_spill));
+}
@@ -29,12 +29,11 @@ static inline void reelfunc_inc_tableptr_tableptr(reel_ctx *ctx, const tdb_event
           lval->table_field == rval->table_field &&
           lval->table_value_type == rval->table_value_type)){
         ctx->error = REEL_TABLE_MISMATCH;
-    }else{
-        uint64_t *dst = (uint64_t*)lval->value;
-        const uint64_t *src = (uint64_t*)rval->value;
-        uint64_t i;
-        for (i = 0; i < lval->table_length; i++)
-            dst[i] += src[i];
+    }else if (lval->table_field){
+        if (reel_table_combine((reel_table*)lval->value,
+                               (const reel_table*)rval->value,
+                               0))
+            ctx->error = REEL_OUT_OF_MEMORY;
     }
 }
 
@@ -43,8 +42,10 @@ static inline void reelfunc_inc_tableitem_uint(reel_ctx *ctx, const tdb_event *e
     if (lval->table_value_type != REEL_UINT){
         ctx->error = REEL_TABLE_MISMATCH;
     }else if (lval->table_field){
-        uint64_t *dst = (uint64_t*)lval->value;
-        dst[tdb_item_val(ev->items[lval->table_field - 1])] += rval;
+        reel_table_inc(ctx,
+                       (reel_table*)lval->value,
+                       tdb_item_val(ev->items[lval->table_field - 1]),
+                       rval);
     }
 }
 
@@ -55,10 +56,11 @@ static inline void reelfunc_inc_tableitem_tableitem(reel_ctx *ctx, const tdb_eve
           lval->table_field == rval->table_field))
         ctx->error = REEL_TABLE_MISMATCH;
     else if (lval->table_field){
-        const uint64_t *src = (const uint64_t*)rval->value;
-        uint64_t *dst = (uint64_t*)lval->value;
         uint64_t idx = tdb_item_val(ev->items[lval->table_field - 1]);
-        dst[idx] += src[idx];
+        reel_table_inc(ctx,
+                       (reel_table*)lval->value,
+                       idx,
+                       reel_table_get((const reel_table*)rval->value, idx));
     }
 }
 
@@ -83,12 +85,11 @@ static inline void reelfunc_dec_tableptr_tableptr(reel_ctx *ctx, const tdb_event
           lval->table_field == rval->table_field &&
           lval->table_value_type == rval->table_value_type)){
         ctx->error = REEL_TABLE_MISMATCH;
-    }else{
-        uint64_t *dst = (uint64_t*)lval->value;
-        const uint64_t *src = (uint64_t*)rval->value;
-        uint64_t i;
-        for (i = 0; i < lval->table_length; i++)
-            safe_dec(&dst[i], src[i]);
+    }else if (lval->table_field){
+        if (reel_table_combine((reel_table*)lval->value,
+                               (const reel_table*)rval->value,
+                               1))
+            ctx->error = REEL_OUT_OF_MEMORY;
     }
 }
 
@@ -97,8 +98,11 @@ static inline void reelfunc_dec_tableitem_uint(reel_ctx *ctx, const tdb_event *e
     if (lval->table_value_type != REEL_UINT){
         ctx->error = REEL_TABLE_MISMATCH;
     }else if (lval->table_field){
-        uint64_t *dst = (uint64_t*)lval->value;
-        safe_dec(&dst[tdb_item_val(ev->items[lval->table_field - 1])], rval);
+        reel_table *dst = (reel_table*)lval->value;
+        uint64_t idx = tdb_item_val(ev->items[lval->table_field - 1]);
+        uint64_t val = reel_table_get(dst, idx);
+        safe_dec(&val, rval);
+        reel_table_set(ctx, dst, idx, val);
     }
 }
 
@@ -109,10 +113,11 @@ static inline void reelfunc_dec_tableitem_tableitem(reel_ctx *ctx, const tdb_eve
           lval->table_field == rval->table_field))
         ctx->error = REEL_TABLE_MISMATCH;
     else if (lval->table_field){
-        const uint64_t *src = (const uint64_t*)rval->value;
-        uint64_t *dst = (uint64_t*)lval->value;
+        reel_table *dst = (reel_table*)lval->value;
         uint64_t idx = tdb_item_val(ev->items[lval->table_field - 1]);
-        safe_dec(&dst[idx], src[idx]);
+        uint64_t val = reel_table_get(dst, idx);
+        safe_dec(&val, reel_table_get((const reel_table*)rval->value, idx));
+        reel_table_set(ctx, dst, idx, val);
     }
 }
 
@@ -139,8 +144,10 @@ static inline void reelfunc_set_tableitem_uint(reel_ctx *ctx, const tdb_event *e
     if (lval->table_value_type != REEL_UINT){
         ctx->error = REEL_TABLE_MISMATCH;
     }else if (lval->table_field){
-        uint64_t *dst = (uint64_t*)lval->value;
-        dst[tdb_item_val(ev->items[lval->table_field - 1])] = rval;
+        reel_table_set(ctx,
+                       (reel_table*)lval->value,
+                       tdb_item_val(ev->items[lval->table_field - 1]),
+                       rval);
     }
 }
 
@@ -149,8 +156,10 @@ static inline void reelfunc_set_tableitem_uintptr(reel_ctx *ctx, const tdb_event
     if (lval->table_value_type != REEL_UINT){
         ctx->error = REEL_TABLE_MISMATCH;
     }else if (lval->table_field){
-        uint64_t *dst = (uint64_t*)lval->value;
-        dst[tdb_item_val(ev->items[lval->table_field - 1])] = *rval;
+        reel_table_set(ctx,
+                       (reel_table*)lval->value,
+                       tdb_item_val(ev->items[lval->table_field - 1]),
+                       *rval);
     }
 }
 
@@ -159,8 +168,8 @@ static inline void reelfunc_set_uintptr_tableitem(reel_ctx *ctx, const tdb_event
     if (rval->table_value_type != REEL_UINT){
         ctx->error = REEL_TABLE_MISMATCH;
     }else if (rval->table_field){
-        const uint64_t *src = (uint64_t*)rval->value;
-        *lval = src[tdb_item_val(ev->items[rval->table_field - 1])];
+        *lval = reel_table_get((const reel_table*)rval->value,
+                               tdb_item_val(ev->items[rval->table_field - 1]));
     }else
         *lval = 0;
 }
@@ -168,17 +177,16 @@ static inline void reelfunc_set_uintptr_tableitem(reel_ctx *ctx, const tdb_event
 /* unset */
 
 static inline void reelfunc_unset_tableptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *val){
-    if (val->table_field){
-        uint64_t *dst = (uint64_t*)val->value;
-        memset(dst, 0, val->table_length * 8);
-    }
+    if (val->table_field)
+        reel_table_reset((reel_table*)val->value);
 }
 
 static inline void reelfunc_unset_tableitem(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *val){
-    if (val->table_field){
-        uint64_t *dst = (uint64_t*)val->value;
-        dst[tdb_item_val(ev->items[val->table_field - 1])] = 0;
-    }
+    if (val->table_field)
+        reel_table_set(ctx,
+                       (reel_table*)val->value,
+                       tdb_item_val(ev->items[val->table_field - 1]),
+                       0);
 }
 
 static inline void reelfunc_unset_itemptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, tdb_item *val){
@@ -218,10 +226,9 @@ static inline int reelfunc_if_uint(reel_ctx *ctx, const tdb_event *ev, uint32_t
 static inline int reelfunc_if_tableitem(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, reel_var *val){
     if (val->table_value_type != REEL_UINT)
         ctx->error = REEL_TABLE_MISMATCH;
-    else if (val->table_field){
-        const uint64_t *src = (const uint64_t*)val->value;
-        return src[tdb_item_val(ev->items[val->table_field - 1])] != 0;
-    }
+    else if (val->table_field)
+        return reel_table_get((const reel_table*)val->value,
+                              tdb_item_val(ev->items[val->table_field - 1])) != 0;
     return 0;
 }
 
@@ -239,49 +246,46 @@ static inline int reelfunc_if_uintptr_uint(reel_ctx *ctx, const tdb_event *ev, u
 
 /* identity */
 
-#define MAX_ID_ITEMS 6
-
-static int reel_identity(reel_ctx *ctx, uint64_t *dst, const uint64_t args[MAX_ID_ITEMS])
+static inline int reel_identity(reel_ctx *ctx,
+                                reel_id_class cls,
+                                uint64_t *dst,
+                                const uint64_t *args)
 {
-    Word_t *ptr;
-    JHSI(ptr, ctx->identities, (uint8_t*)args, MAX_ID_ITEMS * sizeof(uint64_t))
-    if (!*ptr){
-        *ptr = *dst = ++ctx->identity_counter;
-        return 1;
-    }else{
-        *dst = *ptr;
+    int ret = reel_id_get(ctx->identities, cls, args, dst);
+    if (ret < 0){
+        ctx->error = REEL_OUT_OF_MEMORY;
         return 0;
     }
+    return ret;
 }
 
 static inline int reelfunc_id_uintptr_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *lval, uint64_t v1){
-    uint64_t args[MAX_ID_ITEMS] = {v1, 0, 0, 0, 0, 0};
-    return reel_identity(ctx, lval, args);
+    return reel_identity(ctx, REEL_ID_ONE, lval, &v1);
 }
 
 static inline int reelfunc_id_uintptr_item_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *lval, uint64_t v1, uint64_t v2){
-    uint64_t args[MAX_ID_ITEMS] = {v1, v2, 0, 0, 0, 0};
-    return reel_identity(ctx, lval, args);
+    uint64_t args[2] = {v1, v2};
+    return reel_identity(ctx, REEL_ID_TWO, lval, args);
 }
 
 static inline int reelfunc_id_uintptr_item_item_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *lval, uint64_t v1, uint64_t v2, uint64_t v3){
-    uint64_t args[MAX_ID_ITEMS] = {v1, v2, v3, 0, 0, 0};
-    return reel_identity(ctx, lval, args);
+    uint64_t args[MAX_ID_ITEMS + 1] = {v1, v2, v3, 0, 0, 0, 3};
+    return reel_identity(ctx, REEL_ID_MANY, lval, args);
 }
 
 static inline int reelfunc_id_uintptr_item_item_item_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *lval, uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4){
-    uint64_t args[MAX_ID_ITEMS] = {v1, v2, v3, v4, 0, 0};
-    return reel_identity(ctx, lval, args);
+    uint64_t args[MAX_ID_ITEMS + 1] = {v1, v2, v3, v4, 0, 0, 4};
+    return reel_identity(ctx, REEL_ID_MANY, lval, args);
 }
 
 static inline int reelfunc_id_uintptr_item_item_item_item_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *lval, uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4, uint64_t v5){
-    uint64_t args[MAX_ID_ITEMS] = {v1, v2, v3, v4, v5, 0};
-    return reel_identity(ctx, lval, args);
+    uint64_t args[MAX_ID_ITEMS + 1] = {v1, v2, v3, v4, v5, 0, 5};
+    return reel_identity(ctx, REEL_ID_MANY, lval, args);
 }
 
 static inline int reelfunc_id_uintptr_item_item_item_item_item_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *lval, uint64_t v1, uint64_t v2, uint64_t v3, uint64_t v4, uint64_t v5, uint64_t v6){
-    uint64_t args[MAX_ID_ITEMS] = {v1, v2, v3, v4, v5, v6};
-    return reel_identity(ctx, lval, args);
+    uint64_t args[MAX_ID_ITEMS + 1] = {v1, v2, v3, v4, v5, v6, 6};
+    return reel_identity(ctx, REEL_ID_MANY, lval, args);
 }
 
 /* time_before */
@@ -346,36 +350,81 @@ static inline void reelfunc_print_uint(reel_ctx *ctx, const tdb_event *ev, uint3
 
 /* tables */
 
-static int reel_init_table(reel_var *var, const tdb *db, const char *field_name)
+static int reel_init_table(reel_arena *arena,
+                           reel_var *var,
+                           const tdb *db,
+                           const char *field_name,
+                           reel_table_width width)
 {
-    uintptr_t *p;
+    reel_table *table;
     if (tdb_get_field(db, field_name, &var->table_field)){
         var->value = var->table_field = var->table_length = 0;
         return 0;
     }
     var->table_length = tdb_lexicon_size(db, var->table_field);
-    if (!(p = calloc(1, var->table_length * sizeof(uintptr_t))))
+    if (!(table = reel_table_new(arena, var->table_length, width)))
         return -1;
-    var->value = (uintptr_t)p;
+    var->value = (uintptr_t)table;
     return 0;
 }
 
 /* fork */
 
-static reel_ctx *reel_clone(const reel_ctx *src,
+/*
+Children allocate from an arena of their own, separate from the arena
+of their root, so that they can be freed after spilling them.
+*/
+static inline reel_arena *reel_fork_arena(reel_ctx *root)
+{
+    if (!root->fork_arena)
+        root->fork_arena = reel_arena_new();
+    return root->fork_arena;
+}
+
+/*
+Clone a context. If arena is NULL, the clone becomes a new root with an
+arena of its own. Otherwise it is allocated from the given arena and is
+freed with the root owning it. Unless do_reset is set, tables of the
+clone share pages with src, so src must not be freed before the clone,
+and src gives up the ownership of its pages: both copy a shared page
+before writing to it.
+*/
+static reel_ctx *reel_clone(reel_ctx *src,
                             tdb *db,
+                            reel_arena *arena,
                             int do_reset,
                             int do_deep_copy)
 {
     uint64_t i;
-    reel_ctx *ctx;
+    reel_ctx *ctx = NULL;
+    reel_arena *new_arena = NULL;
 
-    if (!(ctx = malloc(sizeof(reel_ctx))))
+    if (!arena && !(arena = new_arena = reel_arena_new()))
         return NULL;
+    if (!(ctx = reel_arena_alloc(arena, sizeof(reel_ctx))))
+        goto out_of_mem;
 
     memcpy(ctx, src, sizeof(reel_ctx));
+    ctx->arena = arena;
     ctx->trail_id = 0;
 
+    /*
+    Make the new context a parent context.
+    This may be changed later (see below).
+    */
+    ctx->root = ctx;
+    ctx->generation = 0;
+    ctx->halted = 0;
+    memset(&ctx->fork_stats, 0, sizeof(reel_fork_stats));
+    ctx->fork_counts = NULL;
+    ctx->memory_limit = 0;
+    ctx->fork_arena = NULL;
+    memset(&ctx->forks, 0, sizeof(reel_fork_map));
+    memset(&ctx->partition, 0, sizeof(reel_partition));
+    memset(&ctx->batch, 0, sizeof(reel_batch));
+    memset(&ctx->spill, 0, sizeof(reel_spill));
+    ctx->lexicons = NULL;
+
     if (db)
         ctx->db = db;
 
@@ -385,113 +434,211 @@ static reel_ctx *reel_clone(const reel_ctx *src,
         if (v->table_field){
             /* const tables are shared */
             if (!(v->flags & REEL_FLAG_IS_CONST)){
-                char *p;
-                if (!(p = calloc(v->table_length, sizeof(uintptr_t))))
+                reel_table *table;
+                if (!(table = reel_table_clone(arena,
+                                               (reel_table*)v->value,
+                                               do_reset)))
                     goto out_of_mem;
-                v->value = (uintptr_t)p;
-                if (!do_reset)
-                    memcpy(p,
-                           (const char*)v->value,
-                           v->table_length * sizeof(uintptr_t));
-
+                v->value = (uintptr_t)table;
             }
         }else if (do_reset)
             /* zero scalar variables */
             v->value = 0;
+        else if (v->type == REEL_HLL && v->value){
+            /* sketches are copied */
+            reel_hll *hll;
+            if (!(hll = reel_hll_new(arena, (const reel_hll*)v->value)))
+                goto out_of_mem;
+            v->value = (uintptr_t)hll;
+        }else if (v->type == REEL_BITMAP && v->value){
+            reel_bitmap *bitmap;
+            if (!(bitmap = reel_bitmap_copy(arena, (const reel_bitmap*)v->value)))
+                goto out_of_mem;
+            v->value = (uintptr_t)bitmap;
+        }else if (v->type == REEL_QUANTILES && v->value){
+            reel_quantiles *q;
+            if (!(q = reel_quantiles_copy(arena, (const reel_quantiles*)v->value)))
+                goto out_of_mem;
+            v->value = (uintptr_t)q;
+        }else if (v->type == REEL_FUNNEL && v->value){
+            uint64_t *counts;
+            if (!(counts = reel_funnel_copy(arena, v, (const uint64_t*)v->value)))
+                goto out_of_mem;
+            v->value = (uintptr_t)counts;
+        }
     }
 
-    /*
-    Make the new context a parent context.
-    This may be changed later (see below).
-    */
-    ctx->root = ctx;
-    ctx->child_contexts = NULL;
-    ctx->evaluated_contexts = NULL;
-
     if (do_deep_copy){
-        Word_t *ptr;
-        Word_t key = 0;
-
-        JLF(ptr, src->child_contexts, key);
-        while (ptr){
-            const reel_ctx *src_child = (const reel_ctx*)*ptr;
-            reel_ctx *dst_child = reel_clone(src_child, db, do_reset, 0);
-            if (!dst_child)
+        for (i = 0; i < src->forks.num_children; i++){
+            const reel_fork_entry *e = &src->forks.children[i];
+            reel_arena *fork_arena = reel_fork_arena(ctx);
+            reel_ctx *dst_child;
+            if (!fork_arena ||
+                !(dst_child = reel_clone(e->child, db, fork_arena, do_reset, 0)))
                 goto out_of_mem;
             dst_child->root = ctx;
-            JLI(ptr, ctx->child_contexts, key);
-            *ptr = (Word_t)dst_child;
-            JLN(ptr, src->child_contexts, key);
+            if (reel_fork_put(&ctx->forks, e->key, dst_child))
+                goto out_of_mem;
         }
+        if (!do_reset && reel_spill_copy_runs(&ctx->spill, &src->spill))
+            goto out_of_mem;
     }
     return ctx;
 out_of_mem:
-    /* XXX we leak some memory here, tables and children are not freed */
-    free(ctx);
+    /* memory allocated from an existing arena is freed with its root */
+    if (ctx){
+        reel_fork_free(&ctx->forks);
+        reel_spill_free(&ctx->spill);
+        reel_arena_free(ctx->fork_arena);
+    }
+    reel_arena_free(new_arena);
     return NULL;
 }
 
-static int reel_fork(reel_ctx *ctx, Word_t key)
+/* clone a context with zeroed variables, which shares nothing with src */
+static reel_ctx *reel_clone_empty(const reel_ctx *src, reel_arena *arena)
 {
-    int not_exists;
-    J1S(not_exists, ctx->root->evaluated_contexts, key);
-    if (!not_exists){
+    /* a reset clone doesn't change the pages of src */
+    return reel_clone((reel_ctx*)src, NULL, arena, 1, 0);
+}
+
+/*
+Count the children created by a fork statement and fail with
+REEL_MEMORY_LIMIT once the root uses more than its memory limit.
+*/
+static int reel_fork_account(reel_ctx *root, uint32_t func_idx)
+{
+    const uint64_t num_funcs = sizeof(root->funcstate) / sizeof(void*);
+
+    ++root->fork_stats.children_created;
+    if (!root->fork_counts &&
+        !(root->fork_counts = reel_arena_calloc(root->arena,
+                                                num_funcs * sizeof(uint64_t))))
+        return REEL_OUT_OF_MEMORY;
+    ++root->fork_counts[func_idx];
+    if (root->memory_limit && reel_memory(root) > root->memory_limit)
+        return REEL_MEMORY_LIMIT;
+    return 0;
+}
+
+/*
+Children are evaluated at most once per trail: a child is stamped with
+the generation of its root when it is evaluated, and the root starts a
+new generation for every trail.
+*/
+static int reel_fork(reel_ctx *ctx, uint32_t func_idx, uint64_t key, int is_item)
+{
+    reel_ctx *root = ctx->root;
+    reel_fork_map *map = &root->forks;
+    reel_ctx *child;
+    int is_hashed, err;
+
+    if (is_item)
+        reel_fork_index(map, ctx->db, key);
+
+    /* runs of events with the same key skip the hash table */
+    if ((is_hashed = !reel_fork_index_slot(map, key)) &&
+        key == map->last_key &&
+        root->generation == map->last_generation)
         return 0;
-    }else{
-        Word_t *ptr;
-
-        JLI(ptr, ctx->root->child_contexts, key);
-        if (!*ptr){
-            reel_ctx *child = reel_clone(ctx, NULL, 1, 0);
-            if (!child){
-                ctx->error = REEL_FORK_FAILED;
-                return 0;
-            }
-            *ptr = (Word_t)child;
+
+    if (!(child = reel_fork_get(map, key))){
+        reel_arena *arena = reel_fork_arena(root);
+        if (!arena || !(child = reel_clone_empty(ctx, arena)))
+            goto error;
+        /* children fork in the same key space as their parent */
+        child->root = root;
+        if (reel_fork_put(map, key, child))
+            goto error;
+        if ((err = reel_fork_account(root, func_idx))){
+            ctx->error = err;
+            return 0;
         }
-        ctx->child = (reel_ctx*)*ptr;
-        return 1;
+    }else if (child->generation == root->generation)
+        child = NULL;
+
+    if (is_hashed){
+        map->last_key = key;
+        map->last_generation = root->generation;
     }
+    if (!child)
+        return 0;
+    child->generation = root->generation;
+    ctx->child = child;
+    ++root->fork_stats.activations;
+    return 1;
+error:
+    ctx->error = REEL_FORK_FAILED;
+    return 0;
 }
 
 static inline int reelfunc_fork_item(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t val){
-    return reel_fork(ctx, (Word_t)val);
+    return reel_fork(ctx, func_idx, val, 1);
 }
 
 static inline int reelfunc_fork_uint(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t val){
-    return reel_fork(ctx, (Word_t)val);
+    return reel_fork(ctx, func_idx, val, 0);
 }
 
 static inline int reelfunc_fork_uintptr(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx, uint64_t *val){
-    return reel_fork(ctx, (Word_t)*val);
+    return reel_fork(ctx, func_idx, *val, 0);
 }
 
 static inline void reelfunc_fork_reset_active(reel_ctx *ctx, const tdb_event *ev, uint32_t func_idx){
-    Word_t tmp;
-    J1FA(tmp, ctx->root->evaluated_contexts);
+    ++ctx->root->generation;
 }
 
 static int reel_get_forks(const reel_ctx *ctx, reel_ctx **ctxs, uint64_t *num_ctxs, uint64_t *ctxs_size)
 {
-    Word_t num, key = 0;
-    Word_t *ptr;
+    uint64_t i, num = ctx->forks.num_children;
+    reel_fork_entry *sorted;
 
-    JLC(num, ctx->child_contexts, 0, -1);
     if (num > *ctxs_size){
         if (!(ctxs = realloc(ctxs, num * sizeof(reel_ctx*))))
             return -1;
         *ctxs_size = num;
     }
+    if (!(sorted = reel_fork_sorted(&ctx->forks)))
+        return -1;
+    for (i = 0; i < num; i++)
+        ctxs[i] = sorted[i].child;
     *num_ctxs = num;
-    num = 0;
-    JLF(ptr, ctx->child_contexts, key);
-    while (ptr){
-        ctxs[num++] = (reel_ctx*)*ptr;
-        JLN(ptr, ctx->child_contexts, key);
-    }
+    free(sorted);
     return 0;
 }
 
+/* free the lexicon indices of the fields, see reel_lexicon_index */
+static void reel_lexicons_free(reel_ctx *ctx)
+{
+    uint64_t i;
+    Word_t tmp;
+    if (ctx->lexicons){
+        for (i = 0; i < tdb_num_fields(ctx->db); i++)
+            JHSFA(tmp, ctx->lexicons[i]);
+        free(ctx->lexicons);
+    }
+}
+
+/*
+Free a root context and all its children. Children are allocated from
+an arena of their root, so freeing a child alone is a no-op.
+*/
+static void reel_free(reel_ctx *ctx)
+{
+    if (!ctx || ctx != ctx->root)
+        return;
+
+    reel_lexicons_free(ctx);
+    reel_fork_free(&ctx->forks);
+    reel_partition_free(&ctx->partition);
+    reel_batch_free(&ctx->batch);
+    reel_spill_free(&ctx->spill);
+    if (ctx->identities->owner == ctx)
+        reel_ids_free(ctx->identities);
+    reel_arena_free(ctx->fork_arena);
+    reel_arena_free(ctx->arena);
+}
+
 /* utilities */
 
 static tdb_item reel_resolve_item_literal(const tdb *db, const char *field_name, const char *value)
@@ -0,0 +1,309 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+copy-on-write tables: owned pages always belong to the arena of the
+table, shared pages to the arena of some other table.
+*/
+
+static const uint64_t reel_zero_page[REEL_TABLE_PAGE_SIZE];
+
+static inline reel_table_width reel_width_of(uint64_t val)
+{
+    if (val <= UINT8_MAX)
+        return REEL_WIDTH_8;
+    else if (val <= UINT16_MAX)
+        return REEL_WIDTH_16;
+    else if (val <= UINT32_MAX)
+        return REEL_WIDTH_32;
+    else
+        return REEL_WIDTH_64;
+}
+
+static inline void reel_page_set(void *page,
+                                 reel_table_width width,
+                                 uint64_t idx,
+                                 uint64_t val)
+{
+    switch (width){
+        case REEL_WIDTH_8:
+            ((uint8_t*)page)[idx] = val;
+            break;
+        case REEL_WIDTH_16:
+            ((uint16_t*)page)[idx] = val;
+            break;
+        case REEL_WIDTH_32:
+            ((uint32_t*)page)[idx] = val;
+            break;
+        default:
+            ((uint64_t*)page)[idx] = val;
+    }
+}
+
+static reel_table *reel_table_new(reel_arena *arena,
+                                  uint64_t table_length,
+                                  reel_table_width width)
+{
+    uint64_t i, num_pages;
+    reel_table *table;
+
+    num_pages = (table_length + REEL_TABLE_PAGE_MASK) >> REEL_TABLE_PAGE_BITS;
+    if (!(table = reel_arena_alloc(arena,
+                                   sizeof(reel_table) +
+                                   num_pages * (sizeof(void*) + 1))))
+        return NULL;
+
+    table->arena = arena;
+    table->num_pages = num_pages;
+    table->width = width;
+    table->pages = (void**)&table[1];
+    table->page_flags = (uint8_t*)&table->pages[num_pages];
+    for (i = 0; i < num_pages; i++)
+        table->pages[i] = (void*)reel_zero_page;
+    memset(table->page_flags, 0, num_pages);
+    return table;
+}
+
+static inline void reel_table_release(reel_table *table, uint64_t page)
+{
+    uint8_t flags = table->page_flags[page];
+    if (flags & REEL_PAGE_OWNED)
+        reel_arena_free_page(table->arena,
+                             table->pages[page],
+                             REEL_PAGE_WIDTH(flags));
+    table->pages[page] = (void*)reel_zero_page;
+    table->page_flags[page] = 0;
+}
+
+/*
+Clone a table without copying any values: The new table either shares
+all pages with src or, if do_reset is set, starts with zero pages.
+Shared pages are not owned by src anymore, so neither table writes to
+them in place.
+*/
+static reel_table *reel_table_clone(reel_arena *arena,
+                                    reel_table *src,
+                                    int do_reset)
+{
+    uint64_t i;
+    reel_table *table;
+
+    if (!(table = reel_table_new(arena,
+                                 src->num_pages << REEL_TABLE_PAGE_BITS,
+                                 src->width)))
+        return NULL;
+
+    if (!do_reset){
+        memcpy(table->pages, src->pages, src->num_pages * sizeof(void*));
+        for (i = 0; i < src->num_pages; i++)
+            table->page_flags[i] = src->page_flags[i] &= ~REEL_PAGE_OWNED;
+    }
+    return table;
+}
+
+/*
+Return a writable page that can hold values of the given width. The page
+is copied first if it is not owned and widened if it is too narrow.
+*/
+static void *reel_table_page(reel_table *table,
+                             uint64_t page,
+                             reel_table_width width)
+{
+    uint64_t i;
+    void *p, *old = table->pages[page];
+    uint8_t flags = table->page_flags[page];
+    reel_table_width old_width = REEL_PAGE_WIDTH(flags);
+
+    if ((flags & REEL_PAGE_OWNED) && old_width >= width)
+        return old;
+
+    if (old == reel_zero_page){
+        if (width < table->width)
+            width = table->width;
+        if (!(p = reel_arena_alloc_page(table->arena, width)))
+            return NULL;
+        memset(p, 0, REEL_TABLE_PAGE_SIZE << width);
+    }else{
+        if (width < old_width)
+            width = old_width;
+        if (!(p = reel_arena_alloc_page(table->arena, width)))
+            return NULL;
+        if (width == old_width)
+            memcpy(p, old, REEL_TABLE_PAGE_SIZE << width);
+        else
+            for (i = 0; i < REEL_TABLE_PAGE_SIZE; i++)
+                reel_page_set(p, width, i, reel_page_get(old, old_width, i));
+        if (flags & REEL_PAGE_OWNED)
+            reel_arena_free_page(table->arena, old, old_width);
+    }
+    table->pages[page] = p;
+    table->page_flags[page] = REEL_PAGE_OWNED |
+                              (width << REEL_PAGE_WIDTH_SHIFT);
+    return p;
+}
+
+static int reel_table_store(reel_table *table, uint64_t idx, uint64_t val)
+{
+    uint64_t page = idx >> REEL_TABLE_PAGE_BITS;
+    void *p;
+
+    if (!(p = reel_table_page(table, page, reel_width_of(val))))
+        return -1;
+    reel_page_set(p,
+                  REEL_PAGE_WIDTH(table->page_flags[page]),
+                  idx & REEL_TABLE_PAGE_MASK,
+                  val);
+    return 0;
+}
+
+static inline void reel_table_set(reel_ctx *ctx,
+                                  reel_table *table,
+                                  uint64_t idx,
+                                  uint64_t val)
+{
+    uint64_t page = idx >> REEL_TABLE_PAGE_BITS;
+    uint8_t flags = table->page_flags[page];
+
+    if ((flags & REEL_PAGE_OWNED) &&
+        reel_width_of(val) <= REEL_PAGE_WIDTH(flags))
+        reel_page_set(table->pages[page],
+                      REEL_PAGE_WIDTH(flags),
+                      idx & REEL_TABLE_PAGE_MASK,
+                      val);
+    else if (reel_table_store(table, idx, val))
+        ctx->error = REEL_OUT_OF_MEMORY;
+}
+
+/* the hot path of counting: increment in place unless the value overflows */
+static inline void reel_table_inc(reel_ctx *ctx,
+                                  reel_table *table,
+                                  uint64_t idx,
+                                  uint64_t val)
+{
+    uint64_t page = idx >> REEL_TABLE_PAGE_BITS;
+    uint64_t i = idx & REEL_TABLE_PAGE_MASK;
+    uint8_t flags = table->page_flags[page];
+    void *p = table->pages[page];
+    uint64_t x;
+
+    if (flags & REEL_PAGE_OWNED)
+        switch (REEL_PAGE_WIDTH(flags)){
+            case REEL_WIDTH_8:
+                if ((x = ((uint8_t*)p)[i] + val) <= UINT8_MAX){
+                    ((uint8_t*)p)[i] = x;
+                    return;
+                }
+                break;
+            case REEL_WIDTH_16:
+                if ((x = ((uint16_t*)p)[i] + val) <= UINT16_MAX){
+                    ((uint16_t*)p)[i] = x;
+                    return;
+                }
+                break;
+            case REEL_WIDTH_32:
+                if ((x = ((uint32_t*)p)[i] + val) <= UINT32_MAX){
+                    ((uint32_t*)p)[i] = x;
+                    return;
+                }
+                break;
+            default:
+                ((uint64_t*)p)[i] += val;
+                return;
+        }
+    if (reel_table_store(table, idx, reel_table_get(table, idx) + val))
+        ctx->error = REEL_OUT_OF_MEMORY;
+}
+
+/* memory of the table and of the pages it owns */
+static uint64_t reel_table_memory(const reel_table *table)
+{
+    uint64_t i, size = sizeof(reel_table) + table->num_pages * (sizeof(void*) + 1);
+    for (i = 0; i < table->num_pages; i++)
+        if (table->page_flags[i] & REEL_PAGE_OWNED)
+            size += REEL_TABLE_PAGE_SIZE << REEL_PAGE_WIDTH(table->page_flags[i]);
+    return size;
+}
+
+static void reel_table_reset(reel_table *table)
+{
+    uint64_t i;
+    for (i = 0; i < table->num_pages; i++)
+        reel_table_release(table, i);
+}
+
+/*
+Add src to dst page by page, or subtract it, saturating at zero, if
+do_subtract is set. Zero pages in src are skipped.
+*/
+static int reel_table_combine(reel_table *dst,
+                              const reel_table *src,
+                              int do_subtract)
+{
+    uint64_t i, j, max;
+    uint64_t tmp[REEL_TABLE_PAGE_SIZE];
+
+    for (i = 0; i < src->num_pages; i++){
+        const void *s = src->pages[i];
+        const void *d = dst->pages[i];
+        reel_table_width sw = REEL_PAGE_WIDTH(src->page_flags[i]);
+        reel_table_width dw = REEL_PAGE_WIDTH(dst->page_flags[i]);
+        void *p;
+
+        if (s == reel_zero_page || (do_subtract && d == reel_zero_page))
+            continue;
+
+        if (!do_subtract &&
+            sw == REEL_WIDTH_64 &&
+            dw == REEL_WIDTH_64 &&
+            (dst->page_flags[i] & REEL_PAGE_OWNED)){
+            uint64_t *dd = dst->pages[i];
+            const uint64_t *ss = s;
+            for (j = 0; j < REEL_TABLE_PAGE_SIZE; j++)
+                dd[j] += ss[j];
+            continue;
+        }
+
+        for (max = 0, j = 0; j < REEL_TABLE_PAGE_SIZE; j++){
+            uint64_t x = reel_page_get(d, dw, j);
+            uint64_t y = reel_page_get(s, sw, j);
+            if (do_subtract)
+                tmp[j] = x > y ? x - y: 0;
+            else
+                tmp[j] = x + y;
+            max |= tmp[j];
+        }
+        if (!(p = reel_table_page(dst, i, reel_width_of(max))))
+            return -1;
+        dw = REEL_PAGE_WIDTH(dst->page_flags[i]);
+        for (j = 0; j < REEL_TABLE_PAGE_SIZE; j++)
+            reel_page_set(p, dw, j, tmp[j]);
+    }
+    return 0;
+}
+
+static int reel_table_copy(reel_table *dst, const reel_table *src)
+{
+    uint64_t i;
+    for (i = 0; i < src->num_pages; i++){
+        reel_table_width sw = REEL_PAGE_WIDTH(src->page_flags[i]);
+        void *d;
+
+        reel_table_release(dst, i);
+        if (src->pages[i] != reel_zero_page){
+            if (!(d = reel_table_page(dst, i, sw)))
+                return -1;
+            if (REEL_PAGE_WIDTH(dst->page_flags[i]) == sw)
+                memcpy(d, src->pages[i], REEL_TABLE_PAGE_SIZE << sw);
+            else{
+                uint64_t j;
+                for (j = 0; j < REEL_TABLE_PAGE_SIZE; j++)
+                    reel_page_set(d,
+                                  REEL_PAGE_WIDTH(dst->page_flags[i]),
+                                  j,
+                                  reel_page_get(src->pages[i], sw, j));
+            }
+        }
+    }
+    return 0;
+}
@@ -17,6 +17,7 @@ struct _reel_event_buffer {
     uint64_t offsets_size;
     const tdb_event **events;
     uint64_t events_size;
+    uint64_t num_bytes;
 };
 
 reel_event_buffer *reel_event_buffer_new()
@@ -87,6 +88,7 @@ const tdb_event **reel_event_buffer_fill(reel_event_buffer *buf,
     }
 
     *num_events = i;
+    buf->num_bytes = offset;
     if (i > buf->events_size){
         buf->events_size *= 2;
         buf->events_size += i;
@@ -101,6 +103,19 @@ const tdb_event **reel_event_buffer_fill(reel_event_buffer *buf,
     return buf->events;
 }
 
+uint64_t reel_event_buffer_bytes(const reel_event_buffer *buf)
+{
+    return buf->num_bytes;
+}
+
+uint64_t reel_event_buffer_memory(const reel_event_buffer *buf)
+{
+    return sizeof(reel_event_buffer) +
+           buf->buffer_size +
+           buf->offsets_size * sizeof(uint64_t) +
+           buf->events_size * sizeof(tdb_event*);
+}
+
 const char *reel_error_str(reel_error error)
 {
     switch (error){
@@ -112,6 +127,16 @@ const char *reel_error_str(reel_error error)
             return "Fork failed";
         case REEL_SETPOS_OUT_OF_BOUNDS:
             return "Setpos out of bounds";
+        case REEL_SPILL_FAILED:
+            return "Writing or reading a spill file failed";
+        case REEL_OUTPUT_FAILED:
+            return "Writing output failed";
+        case REEL_UNKNOWN_COLUMN:
+            return "Unknown output column or not a number";
+        case REEL_NOT_A_TABLE:
+            return "Not a table variable";
+        case REEL_MEMORY_LIMIT:
+            return "Memory limit exceeded";
         case REEL_MERGE_NOT_PARENT:
             return "Only root contexts can be merged";
     };
@@ -127,6 +152,10 @@ const char *reel_parse_error_str(reel_parse_error error)
             return "Unknown variable";
         case REEL_PARSE_INVALID_VALUE:
             return "Malformed value";
+        case REEL_PARSE_OUT_OF_MEMORY:
+            return "Out of memory";
+        case REEL_PARSE_TABLE_MISMATCH:
+            return "Binary table is for a different lexicon";
         case REEL_PARSE_UNKNOWN_FIELD:
             return "Unknown field";
         case REEL_PARSE_EMPTY_TABLE:
@@ -17,6 +17,12 @@ const tdb_event **reel_event_buffer_fill(reel_event_buffer *buf,
                                          tdb_cursor *cursor,
                                          uint64_t *num_events);
 
+/* bytes of events copied by the last reel_event_buffer_fill */
+uint64_t reel_event_buffer_bytes(const reel_event_buffer *buf);
+
+/* memory allocated by the buffer */
+uint64_t reel_event_buffer_memory(const reel_event_buffer *buf);
+
 const char *reel_parse_error_str(reel_parse_error error);
 
 const char *reel_error_str(reel_error error);
@@ -19,3 +19,8 @@ else:
     fork $first_field:
         send Key $first_field
         send is_child 1
+    # children of a second field share the map with those of the first
+    if $second_field $second_field='world':
+        fork $second_field:
+            send Key $second_field
+            send is_child 1